@@ -29,7 +29,6 @@
 */
 
 #include "global.h"
-#include "pub_tool_threadstate.h" // for VG_(get_running_tid)()
 
 /*------------------------------------------------------------*/
 /*--- Basic block (BB) operations                          ---*/
@@ -38,42 +37,58 @@
 /* BB hash, resizable */
 bb_hash bbs;
 
-void CGD_(init_bb_hash)() {
-   Int i;
+#if SETUP_BB_FAST_PATH
+/* Incremented whenever a BB is deleted, invalidates all fast paths. */
+UInt CGD_(bb_generation) = 0;
+
+/* Consecutive misses of a fast path before it is replaced. */
+#define FAST_PATH_MAX_MISSES 4
+#endif
 
-   bbs.size    = 8437;
-   bbs.entries = 0;
-   bbs.table = (BB**) CGD_MALLOC("cgd.bb.ibh.1",
-                                 bbs.size * sizeof(BB*));
 
-   for (i = 0; i < bbs.size; i++)
-	   bbs.table[i] = NULL;
+HASH_MAP_FUNCS(bb_hash, BBKey, BB, bb_key_hash_idx, BB_KEY_EQ,
+		"cgd.bb.ibh.1", CGD_(stat).bb_hash_resizes)
+
+static __inline__
+BBKey bb_key(obj_node* obj, PtrdiffT offset)
+{
+   BBKey key;
+
+   key.obj = obj;
+   key.offset = offset;
+
+   return key;
 }
 
-void CGD_(destroy_bb_hash)() {
-	Int i;
+static
+void free_bb(BB* bb)
+{
 	Int size;
 
-	for (i = 0; i < bbs.size; i++) {
-		BB* bb = bbs.table[i];
-		while (bb) {
-			BB* next = bb->next;
+	size = sizeof(BB)
+		+ bb->instr_count * sizeof(InstrInfo)
+		+ (bb->cjmp_count+1) * sizeof(CJmpInfo)
+		+ bb->groups_count * sizeof(InstrGroupInfo);
+	CGD_DATA_FREE(bb, size);
+}
 
-			size = sizeof(BB)
-				+ bb->instr_count * sizeof(InstrInfo)
-				+ (bb->cjmp_count+1) * sizeof(CJmpInfo)
-				+ bb->groups_count * sizeof(InstrGroupInfo);
-			CGD_DATA_FREE(bb, size);
+void CGD_(init_bb_hash)() {
+   bb_hash_init(&bbs, 14);
+}
+
+void CGD_(destroy_bb_hash)() {
+	UInt i;
 
-			bb = next;
+	bb_hash_finish(&bbs);
+	for (i = 0; i < bbs.size; i++) {
+		BB* bb = bb_hash_at(&bbs, i);
+		if (bb) {
+			free_bb(bb);
 			bbs.entries--;
 		}
 	}
 
-	CGD_ASSERT(bbs.entries == 0);
-
-	CGD_FREE(bbs.table);
-	bbs.table = 0;
+	bb_hash_destroy(&bbs);
 }
 
 bb_hash* CGD_(get_bb_hash)()
@@ -81,63 +96,6 @@ bb_hash* CGD_(get_bb_hash)()
   return &bbs;
 }
 
-/* The hash stores BBs according to
- * - ELF object (is 0 for code in anonymous mapping)
- * - BB base as object file offset
- */
-static __inline__
-UInt bb_hash_idx(obj_node* obj, PtrdiffT offset, UInt size)
-{
-  return (((Addr)obj) + offset) % size;
-}
-
-/* double size of bb table  */
-static
-void resize_bb_table(void)
-{
-    Int i, new_size, conflicts1 = 0, conflicts2 = 0;
-    BB **new_table, *curr, *next;
-    UInt new_idx;
-
-    new_size  = 2* bbs.size +3;
-    new_table = (BB**) CGD_MALLOC("cgd.bb.rbt.1",
-                                  new_size * sizeof(BB*));
- 
-    for (i = 0; i < new_size; i++)
-      new_table[i] = NULL;
- 
-    for (i = 0; i < bbs.size; i++) {
-	if (bbs.table[i] == NULL) continue;
- 
-	curr = bbs.table[i];
-	while (NULL != curr) {
-	    next = curr->next;
-
-	    new_idx = bb_hash_idx(curr->obj, curr->offset, new_size);
-
-	    curr->next = new_table[new_idx];
-	    new_table[new_idx] = curr;
-	    if (curr->next) {
-		conflicts1++;
-		if (curr->next->next)
-		    conflicts2++;
-	    }
-
-	    curr = next;
-	}
-    }
-
-    CGD_FREE(bbs.table);
-
-    CGD_DEBUG(0, "Resize BB Hash: %u => %d (entries %u, conflicts %d/%d)\n",
-	     bbs.size, new_size,
-	     bbs.entries, conflicts1, conflicts2);
-
-    bbs.size  = new_size;
-    bbs.table = new_table;
-    CGD_(stat).bb_hash_resizes++;
-}
-
 
 /**
  * Allocate new BB structure (including space for event type list)
@@ -147,17 +105,12 @@ void resize_bb_table(void)
 static BB* new_bb(obj_node* obj, PtrdiffT offset,
 		  UInt instr_count, UInt cjmp_count, Bool cjmp_inverted, UInt groups_count)
 {
-   BB* bb;
-   UInt idx, size;
+   BB *bb, *old;
+   UInt size;
 
    // Remove me later.
    CGD_ASSERT(groups_count > 0);
 
-   /* check fill degree of bb hash table and resize if needed (>80%) */
-   bbs.entries++;
-   if (10 * bbs.entries / bbs.size > 8)
-       resize_bb_table();
-
    size = sizeof(BB) + instr_count * sizeof(InstrInfo)
                      + (cjmp_count+1) * sizeof(CJmpInfo)
                      + groups_count * sizeof(InstrGroupInfo);
@@ -176,14 +129,17 @@ static BB* new_bb(obj_node* obj, PtrdiffT offset,
    bb->fn          = 0;
    bb->line        = 0;
    bb->is_entry    = 0;
+#if SETUP_BB_FAST_PATH
+   bb->fast.passed = -1;
+   bb->fast.jmp = &(bb->jmp[0]);
+#endif
 
    bb->groups = (InstrGroupInfo*) &(bb->jmp[cjmp_count+1]);
    bb->groups_count = groups_count;
 
-   /* insert into BB hash table */
-   idx = bb_hash_idx(obj, offset, bbs.size);
-   bb->next = bbs.table[idx];
-   bbs.table[idx] = bb;
+   /* insert into BB hash table, it should not be there yet */
+   old = bb_hash_put(&bbs, bb_key(obj, offset), bb);
+   CGD_ASSERT(old == 0);
 
    CGD_(stat).distinct_bbs++;
 
@@ -209,15 +165,8 @@ static __inline__
 BB* lookup_bb(obj_node* obj, PtrdiffT offset)
 {
     BB* bb;
-    Int idx;
 
-    idx = bb_hash_idx(obj, offset, bbs.size);
-    bb = bbs.table[idx];
-
-    while(bb) {
-      if ((bb->obj == obj) && (bb->offset == offset)) break;
-      bb = bb->next;
-    }
+    bb = bb_hash_get(&bbs, bb_key(obj, offset));
 
     CGD_DEBUG(5, "  lookup_bb (Obj %s, off %#lx): %p\n",
               obj->name, (UWord)offset, bb);
@@ -317,28 +266,88 @@ BB* CGD_(get_bb)(Addr addr, IRSB* bbIn, /*OUT*/ Bool *seen_before)
   return bb;
 }
 
+#if EXIT_TRANSITIONS > 0
+/*
+ * The groups of a BB passed after the first one until leaving
+ * through an exit are contiguous. Return their size and set
+ * addr to the first one (0 if none).
+ */
+static __inline__
+UInt exit_inner_range(BB* bb, Int passed, Addr* addr) {
+	UInt group = bb->jmp[passed].group;
+
+	if (group == 0) {
+		*addr = 0;
+		return 0;
+	}
+
+	*addr = bb->groups[1].group_addr;
+	return (bb->groups[group].group_addr + bb->groups[group].group_size) - *addr;
+}
+#endif
+
+#if ENABLE_PROFILING && EXIT_TRANSITIONS > 0
+/* Add the count of a transition through the exit passed of bb
+ * to the edges it goes through. */
+static
+void flush_transition(BB* bb, Int passed, CJmpTrans* trans) {
+	CfgNodeBlockCache cache;
+
+	if (trans->count > 0 && trans->src != 0) {
+		cache.count = trans->count;
+
+		cache.size = exit_inner_range(bb, passed, &(cache.addr));
+		if (cache.size > 0) {
+			cache.working = trans->mid;
+			CGD_(cfgnode_flush_edge_count)(trans->cfg, trans->src, &cache);
+		}
+
+		if (trans->next) {
+			cache.addr = trans->next_addr;
+			cache.size = trans->next_size;
+			cache.working = trans->dst;
+			CGD_(cfgnode_flush_edge_count)(trans->cfg, trans->mid, &cache);
+		}
+
+		CGD_HOT_STAT(CGD_(stat).exit_trans.flushes);
+	}
+
+	trans->count = 0;
+}
+
+static
+void flush_bb_counts(BB* bb) {
+	UInt i, j;
+
+	for (i = 0; i <= bb->cjmp_count; i++) {
+		for (j = 0; j < EXIT_TRANSITIONS; j++)
+			flush_transition(bb, i, &(bb->jmp[i].trans[j]));
+	}
+}
+
+void CGD_(bb_flush_all_counts)(void) {
+	UInt i;
+
+	bb_hash_finish(&bbs);
+	for (i = 0; i < bbs.size; i++) {
+		BB* bb = bb_hash_at(&bbs, i);
+		if (bb)
+			flush_bb_counts(bb);
+	}
+}
+#endif
+
 /* Delete the BB info for the bb with unredirected entry-point
    address 'addr'. */
 void CGD_(delete_bb)(Addr addr)
 {
-    BB  *bb, *bp;
-    Int idx, size;
+    BB* bb;
 
     obj_node* obj = obj_of_address(addr);
     PtrdiffT offset = addr - obj->offset;
 
-    idx = bb_hash_idx(obj, offset, bbs.size);
-    bb = bbs.table[idx];
-
-    /* bb points at the current bb under consideration, and bp is the
-       one before. */
-    bp = NULL;
-    while(bb) {
-      if ((bb->obj == obj) && (bb->offset == offset)) break;
-      bp = bb;
-      bb = bb->next;
-    }
-
+    /* unlink it from hash table */
+    bb = bb_hash_remove(&bbs, bb_key(obj, offset));
     if (bb == NULL) {
 		CGD_DEBUG(3, "  delete_bb (Obj %s, off %#lx): NOT FOUND\n",
 			  obj->name, (UWord)offset);
@@ -347,31 +356,341 @@ void CGD_(delete_bb)(Addr addr)
 		return;
     }
 
-    /* unlink it from hash table */
-
-    if (bp == NULL) {
-       /* we found the first one in the list. */
-       tl_assert(bb == bbs.table[idx]);
-       bbs.table[idx] = bb->next;
-    } else {
-       tl_assert(bb != bbs.table[idx]);
-       bp->next = bb->next;
-    }
-
     CGD_DEBUG(3, "  delete_bb (Obj %s, off %#lx): %p\n",
 	      obj->name, (UWord)offset, bb);
 
+#if ENABLE_PROFILING && EXIT_TRANSITIONS > 0
+	// Keep the counts of the transitions of its exits.
+	flush_bb_counts(bb);
+#endif
+
+#if SETUP_BB_FAST_PATH
+	// Other BBs may still expect a transition from this one.
+	CGD_(bb_generation)++;
+#endif
+
     // FIXME: We may be using this BB somewhere else.
 	/* Fill the block up with junk and then free it, so we will
 	   hopefully get a segfault if it is used again by mistake. */
-	size = sizeof(BB)
-		+ bb->instr_count * sizeof(InstrInfo)
-		+ (bb->cjmp_count+1) * sizeof(CJmpInfo)
-		+ bb->groups_count * sizeof(InstrGroupInfo);
-	CGD_DATA_FREE(bb, size);
-	bbs.entries--;
+	free_bb(bb);
+}
+
+/*
+ * Move the working node to the block of the given group of a BB,
+ * probing the working node cache first. The transition is only
+ * counted if count is set.
+ */
+static __inline__
+CfgNode* next_block(CFG* cfg, CfgNode* working, BB* bb, Int group, Bool count) {
+#if CFG_NODE_CACHE_SIZE > 0
+	CfgNodeBlockCache* blockCache;
+
+	blockCache = cfgnode_block_cache_lookup(working,
+			bb->groups[group].group_addr, bb->groups[group].group_size);
+	if (blockCache) {
+#if ENABLE_PROFILING
+		if (count)
+			blockCache->count++;
+#endif // ENABLE_PROFILING
+		return blockCache->working;
+	}
+#endif // CFG_NODE_CACHE_SIZE
+
+#if ENABLE_PROFILING
+	return CGD_(cfgnode_set_block)(cfg, working, bb, group, count ? 1 : 0);
+#else
+	CGD_UNUSED(count);
+	return CGD_(cfgnode_set_block)(cfg, working, bb, group);
+#endif
+}
+
+#if SETUP_BB_FAST_PATH
+/*
+ * Expect the transition into bb through the exit passed of last_bb
+ * in the inline fast path. Another exit is kept until it misses
+ * repeatedly, so alternating predecessors do not thrash it.
+ */
+static
+void set_fast_path(BB* bb, BB* last_bb, Int passed) {
+	BBFastPath* fast = &(bb->fast);
+#if INLINE_EXIT_COUNTS
+	// Only expected if the exit was also counted.
+	Int expected = passed | JMPS_PASSED_COUNTED;
+#else
+	Int expected = passed;
+#endif
+
+	if (fast->passed >= 0 && fast->gen == CGD_(bb_generation) &&
+			(fast->last_bb != last_bb || fast->passed != expected) &&
+			++fast->misses < FAST_PATH_MAX_MISSES)
+		return;
+
+	fast->last_bb = last_bb;
+	fast->passed = expected;
+	fast->gen = CGD_(bb_generation);
+	fast->misses = 0;
+	fast->jmp = &(last_bb->jmp[passed]);
+}
+#endif
+
+#if EXIT_TRANSITIONS > 0
+static __inline__
+Bool is_transition(CJmpTrans* trans, CfgNode* src, BB* next) {
+	return trans->src == src && trans->next == next &&
+			(next == 0 || trans->next_addr == next->groups[0].group_addr);
+}
+
+/*
+ * Make the transition through the exit passed of last_bb from the node
+ * src of cfg, going through the node mid into next (0 if it is not a
+ * jump), the most recent one of the exit. A new one evicts the least
+ * recently used, and the node it reaches (dst) is not known yet.
+ * This execution is counted in it if counted is set (with
+ * INLINE_EXIT_COUNTS, the instrumented code already counted it in
+ * the most recent transition).
+ */
+static
+CJmpTrans* exit_transition(BB* last_bb, Int passed, CFG* cfg, CfgNode* src,
+		CfgNode* mid, BB* next, Bool counted) {
+	CJmpTrans* trans = last_bb->jmp[passed].trans;
+	CJmpTrans tmp;
+	Int i;
+
+	if (is_transition(&(trans[0]), src, next)) {
+#if ENABLE_PROFILING && !INLINE_EXIT_COUNTS
+		if (counted)
+			trans[0].count++;
+#endif
+		CGD_HOT_STAT(CGD_(stat).exit_trans.hits);
+		return &(trans[0]);
+	}
+
+	CGD_HOT_STAT(CGD_(stat).exit_trans.misses);
+
+#if INLINE_EXIT_COUNTS
+	// This execution belongs to the new transition.
+	if (counted && trans[0].count > 0)
+		trans[0].count--;
+	else
+		counted = False;
+#endif
+
+	for (i = 1; i < EXIT_TRANSITIONS; i++) {
+		if (is_transition(&(trans[i]), src, next))
+			break;
+	}
+
+	if (i < EXIT_TRANSITIONS) {
+		tmp = trans[i];
+	} else {
+		// Evict the least recently used transition.
+		i = EXIT_TRANSITIONS - 1;
+		if (trans[i].src != 0)
+			CGD_HOT_STAT(CGD_(stat).exit_trans.evictions);
+#if ENABLE_PROFILING
+		flush_transition(last_bb, passed, &(trans[i]));
+#endif
+
+		tmp.cfg = cfg;
+		tmp.src = src;
+		tmp.mid = mid;
+		tmp.dst = 0;
+		tmp.next = next;
+		tmp.next_addr = next ? next->groups[0].group_addr : 0;
+		tmp.next_size = next ? next->groups[0].group_size : 0;
+#if ENABLE_PROFILING
+		tmp.count = 0;
+#endif
+	}
+
+	VG_(memmove)(&(trans[1]), &(trans[0]), i * sizeof(CJmpTrans));
+	trans[0] = tmp;
+
+#if ENABLE_PROFILING
+	if (counted)
+		trans[0].count++;
+#else
+	CGD_UNUSED(counted);
+#endif
+
+	return &(trans[0]);
+}
+#endif
+
+#if INLINE_EXIT_COUNTS
+/* Take back the inline count of the exit left, if it was counted,
+ * when the transition it leads to is not followed. */
+void CGD_(bb_uncount_exit)(BB* bb, Int jmps_passed) {
+	Int passed = jmps_passed & ~JMPS_PASSED_COUNTED;
+
+	CGD_ASSERT(bb != 0);
+	CGD_ASSERT(passed >= 0 && passed <= bb->cjmp_count);
+
+	if ((jmps_passed & JMPS_PASSED_COUNTED) && bb->jmp[passed].trans[0].count > 0)
+		bb->jmp[passed].trans[0].count--;
+}
+#endif
+
+/* Phantoms are created at the end, so only record each exit once for
+ * the working node it leaves (which is the same most of the time). */
+static __inline__
+void record_exit(BB* bb, Int p) {
+	if (bb->jmp[p].recorded != CGD_(current_state).working) {
+		bb->jmp[p].recorded = CGD_(current_state).working;
+		CGD_(cfgnode_record_exit)(CGD_(current_state).cfg,
+				CGD_(current_state).working, bb->jmp[p].dst,
+				bb->jmp[p].jmpkind, bb->jmp[p].indirect);
+	}
+}
+
+/*
+ * Process the exits of the previous BB left through the exit passed:
+ * move the working node through its remaining groups and record the
+ * exits of each group for the phantom nodes. The shape is always a
+ * constant, so each caller gets only the logic it needs.
+ */
+static __inline__
+void leave_bb(BB* last_bb, Int passed, BBShape shape, Bool exit_counted) {
+	Int p, group;
+
+	// A single exit, the final one.
+	if (shape == bbs_NoSideExits) {
+		CGD_ASSERT(passed == 0 && last_bb->cjmp_count == 0);
+		record_exit(last_bb, 0);
+		return;
+	}
+
+	// The first group was already processed in the end of the previous setup_bbcc.
+	group = 0;
+	for (p = 0; p <= passed; p++) {
+		record_exit(last_bb, p);
+
+		// Only process a new block if it is different from the previous one.
+		if (shape == bbs_Generic && last_bb->jmp[p].group != group) {
+			// The next group must be immediately after the previous.
+			group++;
+			CGD_ASSERT(group == last_bb->jmp[p].group);
+
+			// Counted along with the exit, if it was counted inline.
+			CGD_(current_state).working = next_block(CGD_(current_state).cfg,
+					CGD_(current_state).working, last_bb, group, !exit_counted);
+		}
+	}
+
+	// If there are still jumps in the same group, this means
+	// that they are phantom nodes.
+	while (p <= last_bb->cjmp_count &&
+			(shape == bbs_SingleGroup || last_bb->jmp[p].group == group)) {
+		record_exit(last_bb, p);
+		p++;
+	}
 }
 
+#if ENABLE_PROFILING
+/*
+ * Synchronize the execution state again after BBs were executed without
+ * being profiled (--sample). The frames returned from are unwound and the
+ * working node is placed in the block of the BB's first group, if the
+ * current CFG has it already, without recording any edge. The state is
+ * left unsynchronized otherwise, so the next BBs try again.
+ */
+static
+void sample_resync(BB* bb, Addr sp) {
+	CFG* cfg;
+	CfgNode* working;
+
+	CGD_(unwind_call_stack)(sp, 0);
+
+	cfg = CGD_(current_state).cfg;
+	working = cfg ? CGD_(cfg_find_block)(cfg, bb) : 0;
+
+	// A function was entered in the meantime from an unknown call site.
+	if (!working && bb->is_entry) {
+		// The frame is left without a working node.
+		CGD_(current_state).working = 0;
+		CGD_(push_unrecorded_call)(bb_cfg(bb), sp);
+
+		cfg = CGD_(current_state).cfg;
+		working = next_block(cfg, CGD_(current_state).working, bb, 0, True);
+	}
+
+	if (!working) {
+		CGD_(stat).sample_misses++;
+		return;
+	}
+
+	CGD_(current_state).cfg = cfg;
+	CGD_(current_state).working = working;
+	CGD_(current_state).bb = bb;
+	CGD_(current_state).jmps_passed = 0;
+	CGD_(current_state).burst = CGD_(sample).burst;
+
+	CGD_(stat).sample_resyncs++;
+	CGD_(stat).bb_executions++;
+}
+
+/*
+ * Called for every BB profiled while sampling: the first BB starts
+ * a new burst and the execution state is resynchronized if it missed
+ * BBs. Returns False if setup_bb must not process this BB.
+ */
+static
+Bool sample_enter(BB* bb, Addr sp) {
+	if (CGD_(sample).off) {
+		CGD_(sample).off = False;
+		CGD_(sample).burst++;
+	}
+
+	if (CGD_(current_state).burst == CGD_(sample).burst)
+		return True;
+
+	sample_resync(bb, sp);
+	return False;
+}
+
+/* The burst ends after the last BB profiled. */
+static __inline__
+void sample_leave(void) {
+	if (CGD_(clo).sample.off > 0 && CGD_(sample).left == 0) {
+		CGD_(sample).left = CGD_(clo).sample.on + CGD_(clo).sample.off;
+		CGD_(sample).off = True;
+	}
+}
+#endif
+
+#if !ENABLE_PROFILING
+/*
+ * Set up a BB reached from a frozen CFG (--freeze-complete), whose BBs
+ * run without calling setup_bb, so only the calls and returns on its
+ * boundary are followed. The frames returned from are unwound and a BB
+ * out of the frozen CFG is entered as a call, not recorded in it.
+ */
+static
+void frozen_setup(BB* bb, Addr sp) {
+	CFG* cfg;
+	Addr addr;
+
+	CGD_(unwind_call_stack)(sp, 0);
+
+	cfg = CGD_(current_state).cfg;
+	addr = bb->groups[0].group_addr;
+	if (state_is_tracked()) {
+		// Returned to a tracked CFG: continue from its call site.
+		CGD_(current_state).working = next_block(cfg,
+				CGD_(current_state).working, bb, 0, True);
+	} else if (!CGD_(cfg_has_instr)(cfg, addr)) {
+		CGD_(push_unrecorded_call)(CGD_(get_cfg)(addr), sp);
+		CGD_(current_state).working = next_block(CGD_(current_state).cfg,
+				CGD_(current_state).working, bb, 0, True);
+	}
+
+	CGD_(current_state).bb = bb;
+	CGD_(current_state).jmps_passed = 0;
+
+	CGD_(stat).bb_executions++;
+}
+#endif
+
 /*
  * Helper function called at start of each instrumented BB.
  */
@@ -383,108 +702,81 @@ void CGD_(setup_bb)(BB* bb) {
 	ThreadId tid;
 	BBJumpKind jmpkind;
 	Bool isConditionalJump;
-	Int passed = 0, p, csp;
+	Int passed = 0, csp;
 	Bool ret_without_call = False;
 	Int popcount_on_return = 1;
-#if CFG_NODE_CACHE_SIZE > 0
-	CfgNodeBlockCache* blockCache;
-	CfgNodePhantomCache* phantomCache;
+	Bool jump, exit_counted = False;
+#if EXIT_TRANSITIONS > 0
+	CFG* src_cfg;
+	CfgNode *src, *inner;
+	CJmpTrans* trans = 0;
 #endif
 
 	CGD_DEBUG(3, "+ setup_bb(BB %#lx)\n", bb_addr(bb));
 
-	/* This is needed because thread switches can not reliable be tracked
-	 * with callback CGD_(run_thread) only: we have otherwise no way to get
-	 * the thread ID after a signal handler returns.
-	 * This could be removed again if that bug is fixed in Valgrind.
-	 * This is in the hot path but hopefully not to costly.
-	 */
-	tid = VG_(get_running_tid)();
-#if 1
-	/* CGD_(switch_thread) is a no-op when tid is equal to CGD_(current_tid).
-	 * As this is on the hot path, we only call CGD_(switch_thread)(tid)
-	 * if tid differs from the CGD_(current_tid).
+	/* Thread switches are tracked by the scheduler and signal callbacks
+	 * (see cdg_start_client_code_callback and CGD_(post_signal)), so
+	 * CGD_(current_tid) is always the running thread here.
 	 */
-	if (UNLIKELY(tid != CGD_(current_tid)))
-		CGD_(switch_thread)(tid);
-#else
-	CGD_ASSERT(VG_(get_running_tid)() == CGD_(current_tid));
+	tid = CGD_(current_tid);
+
+#if EXIT_TRANSITIONS > 0
+	src_cfg = CGD_(current_state).cfg;
+	src = CGD_(current_state).working;
+	inner = 0;
 #endif
 
 	sp = VG_(get_SP)(tid);
+
+#if ENABLE_PROFILING
+	if (CGD_(clo).sample.off > 0 && !sample_enter(bb, sp)) {
+		sample_leave();
+		return;
+	}
+#endif
+
+#if !ENABLE_PROFILING
+	// The previous BBs of a frozen CFG were not tracked.
+	if (CGD_(current_state).bb && !state_is_tracked()) {
+		frozen_setup(bb, sp);
+		return;
+	}
+#endif
+
 	last_bb = CGD_(current_state).bb;
 
 	if (last_bb) {
-		Int group;
-
 		passed = CGD_(current_state).jmps_passed;
+#if INLINE_EXIT_COUNTS
+		// Otherwise the BB was left abnormally, or not counted at all,
+		// and its transition is counted here instead.
+		exit_counted = (passed & JMPS_PASSED_COUNTED) != 0;
+		passed &= ~JMPS_PASSED_COUNTED;
+#elif ENABLE_PROFILING && EXIT_TRANSITIONS > 0
+		// Counted along with its transition below.
+		exit_counted = True;
+#endif
 		CGD_ASSERT(passed <= last_bb->cjmp_count);
 
 		jmpkind = last_bb->jmp[passed].jmpkind;
 		isConditionalJump = (passed < last_bb->cjmp_count);
 
-		// The first group was already processed in the end of the previous setup_bbcc.
-		group = 0;
-		for (p = 0; p <= passed; p++) {
-#if CFG_NODE_CACHE_SIZE > 0
-			phantomCache = CGD_(current_state).working->cache.phantom ?
-					&(CGD_(current_state).working->cache.phantom[CFG_NODE_CACHE_INDEX(last_bb->jmp[p].dst)]) : 0;
-			if (!phantomCache ||
-					phantomCache->addr != last_bb->jmp[p].dst ||
-					phantomCache->indirect != last_bb->jmp[p].indirect)
-#endif
-				CGD_(cfgnode_set_phantom)(CGD_(current_state).cfg,
-						CGD_(current_state).working, last_bb->jmp[p].dst,
-						last_bb->jmp[p].jmpkind, last_bb->jmp[p].indirect);
-
-			// Only process a new block if it is different from the previous one.
-			if (last_bb->jmp[p].group != group) {
-				// The next group must be immediately after the previous.
-				group++;
-				CGD_ASSERT(group == last_bb->jmp[p].group);
-
-#if CFG_NODE_CACHE_SIZE > 0
-				blockCache = CGD_(current_state).working->cache.block ?
-						&(CGD_(current_state).working->cache.block[CFG_NODE_CACHE_INDEX(last_bb->groups[group].group_addr)]) : 0;
-				if (blockCache &&
-						blockCache->addr == last_bb->groups[group].group_addr &&
-						blockCache->size == last_bb->groups[group].group_size) {
-#if ENABLE_PROFILING
-					blockCache->count++;
-#endif // ENABLE_PROFILING
-					CGD_(current_state).working = blockCache->working;
-				} else {
-#if ENABLE_PROFILING
-					if (blockCache && blockCache->count > 0)
-						CGD_(cfgnode_flush_edge_count)(CGD_(current_state).cfg,
-							CGD_(current_state).working, blockCache);
-#endif // ENABLE_PROFILING
-#endif // CFG_NODE_CACHE_SIZE
-					CGD_(current_state).working = CGD_(cfgnode_set_block)(CGD_(current_state).cfg,
-							CGD_(current_state).working, last_bb, group);
-#if CFG_NODE_CACHE_SIZE > 0
-				}
-#endif
-			}
+		// Constant shapes let the compiler drop the unneeded loops.
+		switch (last_bb->shape) {
+			case bbs_NoSideExits:
+				leave_bb(last_bb, passed, bbs_NoSideExits, exit_counted);
+				break;
+			case bbs_SingleGroup:
+				leave_bb(last_bb, passed, bbs_SingleGroup, exit_counted);
+				break;
+			default:
+				leave_bb(last_bb, passed, bbs_Generic, exit_counted);
+				break;
 		}
 
-		// If there are still jumps in the same group, this means
-		// that they are phantom nodes.
-		while (p <= last_bb->cjmp_count && last_bb->jmp[p].group == group) {
-#if CFG_NODE_CACHE_SIZE > 0
-			phantomCache = CGD_(current_state).working->cache.phantom ?
-					&(CGD_(current_state).working->cache.phantom[CFG_NODE_CACHE_INDEX(last_bb->jmp[p].dst)]) : 0;
-
-			if (!phantomCache ||
-					phantomCache->addr != last_bb->jmp[p].dst ||
-					phantomCache->indirect != last_bb->jmp[p].indirect)
+#if EXIT_TRANSITIONS > 0
+		inner = CGD_(current_state).working;
 #endif
-				CGD_(cfgnode_set_phantom)(CGD_(current_state).cfg,
-						CGD_(current_state).working, last_bb->jmp[p].dst,
-						last_bb->jmp[p].jmpkind, last_bb->jmp[p].indirect);
-
-			p++;
-		}
 
 		CGD_DEBUGIF(4) {
 			CGD_(print_execstate)(-2, &CGD_(current_state));
@@ -495,8 +787,8 @@ void CGD_(setup_bb)(BB* bb) {
 		jmpkind = bjk_None;
 		isConditionalJump = False;
 
-		called = CGD_(get_cfg)(bb->groups[0].group_addr);
-		if (CGD_(current_state).sig > 0)
+		called = bb_cfg(bb);
+		if (CGD_(current_state).sig > 0 && state_is_tracked())
 			CGD_(cfgnode_set_signal_handler)(CGD_(current_state).cfg,
 				CGD_(current_state).working, called, CGD_(current_state).sig);
 
@@ -505,6 +797,8 @@ void CGD_(setup_bb)(BB* bb) {
 
 #if ENABLE_PROFILING
 		CGD_(current_state).cfg->stats.execs++;
+#else
+		CGD_(cfg_entered)(called);
 #endif
 	}
 
@@ -623,6 +917,25 @@ void CGD_(setup_bb)(BB* bb) {
 		}
 	}
 
+#if ENABLE_PROFILING
+	// Returned to a call site missed while sampling.
+	if (CGD_(clo).sample.off > 0 && CGD_(current_state).burst != CGD_(sample).burst) {
+#if INLINE_EXIT_COUNTS
+		if (last_bb)
+			CGD_(bb_uncount_exit)(last_bb, CGD_(current_state).jmps_passed);
+#endif
+		sample_resync(bb, sp);
+		sample_leave();
+		return;
+	}
+#else
+	// Returned to a frozen CFG, whose BBs were not tracked since.
+	if (!state_is_tracked()) {
+		frozen_setup(bb, sp);
+		return;
+	}
+#endif
+
 	if (delayed_push) {
 		if (call_emulation)
 			CGD_(cfgnode_remove_successor_with_addr)(CGD_(current_state).cfg,
@@ -633,27 +946,42 @@ void CGD_(setup_bb)(BB* bb) {
 
 	CGD_(current_state).working->info.has_fallthrough |= (jmpkind == bjk_None);
 
-#if CFG_NODE_CACHE_SIZE > 0
-	blockCache = CGD_(current_state).working->cache.block ?
-			&(CGD_(current_state).working->cache.block[CFG_NODE_CACHE_INDEX(bb->groups[0].group_addr)]) : 0;
-	if (blockCache &&
-			blockCache->addr == bb->groups[0].group_addr &&
-			blockCache->size == bb->groups[0].group_size) {
-#if ENABLE_PROFILING
-		blockCache->count++;
-#endif // ENABLE_PROFILING
-		CGD_(current_state).working = blockCache->working;
-	} else {
-#if ENABLE_PROFILING
-		if (blockCache && blockCache->count > 0)
-			CGD_(cfgnode_flush_edge_count)(CGD_(current_state).cfg,
-				CGD_(current_state).working, blockCache);
-#endif // ENABLE_PROFILING
-#endif // CFG_NODE_CACHE_SIZE
-		CGD_(current_state).working = CGD_(cfgnode_set_block)(CGD_(current_state).cfg,
-				CGD_(current_state).working, bb, 0);
-#if CFG_NODE_CACHE_SIZE > 0
+	/* Plain jumps and fall-throughs only depend on the previous BB, the
+	 * exit taken and the working node (unless the call stack needs to be
+	 * unwound, which is also checked inline). */
+	jump = last_bb && jmpkind == last_bb->jmp[passed].jmpkind &&
+			(jmpkind == bjk_None || jmpkind == bjk_Jump);
+
+#if EXIT_TRANSITIONS > 0
+	/* The exit keeps its transition with its count, if it was counted,
+	 * and, for a jump, the node it reaches (without profiling, only
+	 * jumps are kept). */
+	if (ENABLE_PROFILING ? exit_counted : jump) {
+		CGD_ASSERT(!jump || inner == CGD_(current_state).working);
+		trans = exit_transition(last_bb, passed, src_cfg, src, inner,
+				jump ? bb : 0, exit_counted);
 	}
+
+	if (trans && jump && trans->dst) {
+		CGD_(current_state).working = trans->dst;
+	} else
+#endif
+	{
+		// Jumps are counted along with the exit, if it was counted.
+		CGD_(current_state).working = next_block(CGD_(current_state).cfg,
+				CGD_(current_state).working, bb, 0, !(exit_counted && jump));
+#if EXIT_TRANSITIONS > 0
+		if (trans && jump)
+			trans->dst = CGD_(current_state).working;
+#endif
+	}
+
+#if SETUP_BB_FAST_PATH
+	/* Remember the jump, so the instrumented code can
+	 * handle it without calling this helper (unless the
+	 * exit was not counted). */
+	if (trans && jump)
+		set_fast_path(bb, last_bb, passed);
 #endif
 
 	CGD_(current_state).bb = bb;
@@ -667,4 +995,8 @@ void CGD_(setup_bb)(BB* bb) {
 			bb_addr(bb), bb->instr_count, bb->instr_len);
 
 	CGD_(stat).bb_executions++;
+
+#if ENABLE_PROFILING
+	sample_leave();
+#endif
 }
@@ -57,6 +57,7 @@ void CGD_(init_call_stack)(call_stack* s)
   s->entry = (call_entry*) CGD_MALLOC("cgd.callstack.ics.1",
                                       s->size * sizeof(call_entry));
   s->sp = 0;
+  s->top_sp = ~((Addr) 0);
 
   for(i=0; i<s->size; i++) {
 	  s->entry[i].cfg = 0;
@@ -83,6 +84,7 @@ void CGD_(copy_current_call_stack)(call_stack* dst)
   dst->size  = CGD_(current_call_stack).size;
   dst->entry = CGD_(current_call_stack).entry;
   dst->sp    = CGD_(current_call_stack).sp;
+  dst->top_sp = CGD_(current_call_stack).top_sp;
 }
 
 void CGD_(set_current_call_stack)(call_stack* s)
@@ -92,6 +94,7 @@ void CGD_(set_current_call_stack)(call_stack* s)
   CGD_(current_call_stack).size  = s->size;
   CGD_(current_call_stack).entry = s->entry;
   CGD_(current_call_stack).sp    = s->sp;
+  CGD_(current_call_stack).top_sp = s->top_sp;
 }
 
 
@@ -152,27 +155,20 @@ void CGD_(push_call_stack)(BB* from, UInt jmp, BB* to, Addr sp)
     		ret_addr = 0;
     }
 
-    called = CGD_(get_cfg)(to->groups[0].group_addr);
+    called = bb_cfg(to);
 
 	// Let's update the fdesc if it is our first real call to it.
 	if (!CGD_(cfg_fdesc)(called))
 		CGD_(cfg_build_fdesc)(called);
 
 #if CFG_NODE_CACHE_SIZE > 0
-	callCache = CGD_(current_state).working->cache.call ?
-			&(CGD_(current_state).working->cache.call[CFG_NODE_CACHE_INDEX(called->addr)]) : 0;
-	if (callCache &&
-			callCache->called == called &&
-			callCache->indirect == from->jmp[jmp].indirect) {
+	callCache = cfgnode_call_cache_lookup(CGD_(current_state).working,
+			called, from->jmp[jmp].indirect);
+	if (callCache) {
 #if ENABLE_PROFILING
 		callCache->count++;
 #endif // ENABLE_PROFILING
 	} else {
-#if ENABLE_PROFILING
-		if (callCache && callCache->count > 0)
-			CGD_(cfgnode_flush_call_count)(CGD_(current_state).cfg,
-				CGD_(current_state).working, callCache);
-#endif // ENABLE_PROFILING
 #endif // CFG_NODE_CACHE_SIZE
 		CGD_(cfgnode_set_call)(CGD_(current_state).cfg, CGD_(current_state).working,
 				called, from->jmp[jmp].indirect);
@@ -187,6 +183,7 @@ void CGD_(push_call_stack)(BB* from, UInt jmp, BB* to, Addr sp)
     current_entry->working = CGD_(current_state).working;
 
     CGD_(current_call_stack).sp++;
+    CGD_(current_call_stack).top_sp = sp;
 
     /* To allow for above assertion we set context of next frame to 0 */
     CGD_ASSERT(CGD_(current_call_stack).sp < CGD_(current_call_stack).size);
@@ -199,6 +196,46 @@ void CGD_(push_call_stack)(BB* from, UInt jmp, BB* to, Addr sp)
     CGD_(current_state).working = CGD_(cfg_entry_node)(called);
 #if ENABLE_PROFILING
 	called->stats.execs++;
+#else
+	CGD_(cfg_entered)(called);
+#endif
+}
+
+
+/* Push a call that is not recorded in the calling CFG: either its
+ * call site was missed while sampling (the frame is then left without
+ * a working node), or the caller is a frozen CFG.
+ */
+void CGD_(push_unrecorded_call)(CFG* called, Addr sp)
+{
+    call_entry* current_entry;
+
+    ensure_stack_size(CGD_(current_call_stack).sp +1);
+    current_entry = &(CGD_(current_call_stack).entry[CGD_(current_call_stack).sp]);
+
+	if (!CGD_(cfg_fdesc)(called))
+		CGD_(cfg_build_fdesc)(called);
+
+    current_entry->sp = sp;
+    current_entry->ret_addr = 0;
+    current_entry->cfg = CGD_(current_state).cfg;
+    current_entry->working = CGD_(current_state).working;
+
+    CGD_(current_call_stack).sp++;
+    CGD_(current_call_stack).top_sp = sp;
+
+    CGD_ASSERT(CGD_(current_call_stack).sp < CGD_(current_call_stack).size);
+    current_entry++;
+
+    current_entry->cfg = 0;
+    current_entry->working = 0;
+
+    CGD_(current_state).cfg = called;
+    CGD_(current_state).working = CGD_(cfg_entry_node)(called);
+#if ENABLE_PROFILING
+    called->stats.execs++;
+#else
+    CGD_(cfg_entered)(called);
 #endif
 }
 
@@ -223,26 +260,41 @@ void CGD_(pop_call_stack)(Bool halt) {
     CGD_DEBUG(4,"+ pop_call_stack: frame %d\n",
 		CGD_(current_call_stack).sp);
 
-	if (halt) {
-		CGD_(cfgnode_set_halt)(CGD_(current_state).cfg, CGD_(current_state).working);
-	} else {
+	// The exit of a state that missed BBs, or is frozen, is unknown.
+	if (state_is_tracked()) {
+		if (halt) {
+			CGD_(cfgnode_set_halt)(CGD_(current_state).cfg, CGD_(current_state).working);
+		} else {
 #if CFG_NODE_CACHE_SIZE > 0
-		if (CGD_(current_state).working->cache.exit.enabled) {
+			if (CGD_(current_state).working->cache.exit.enabled) {
 #if ENABLE_PROFILING
-			CGD_(current_state).working->cache.exit.count++;
+				CGD_(current_state).working->cache.exit.count++;
 #endif
-		} else
+				CGD_HOT_STAT(CGD_(stat).exit_cache.hits);
+			} else {
+				CGD_HOT_STAT(CGD_(stat).exit_cache.misses);
 #endif
-			CGD_(cfgnode_set_exit)(CGD_(current_state).cfg, CGD_(current_state).working);
-    }
+				CGD_(cfgnode_set_exit)(CGD_(current_state).cfg, CGD_(current_state).working);
+#if CFG_NODE_CACHE_SIZE > 0
+			}
+#endif
+		}
+	}
 
 	CGD_(current_state).cfg = lower_entry->cfg;
 	CGD_(current_state).working = lower_entry->working;
+#if ENABLE_PROFILING
+	// The call site of a call missed while sampling is unknown.
+	if (!lower_entry->working)
+		CGD_(current_state).burst = 0;
+#endif
 
 	lower_entry->cfg = 0;
 	lower_entry->working = 0;
 
     CGD_(current_call_stack).sp--;
+    CGD_(current_call_stack).top_sp = CGD_(current_call_stack).sp > 0 ?
+    		lower_entry[-1].sp : ~((Addr) 0);
 }
 
 
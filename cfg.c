@@ -28,10 +28,17 @@
 #include "global.h"
 
 struct _CfgInstrRef {
-	UniqueInstr* instr;	// The instruction itself.
 	CfgNode* node;		// Reference to the CFG node.
+	Int index;			// Position in the block, offset by its base.
+};
+
+/* The references of the instructions in a CFG, by their address */
+HASH_MAP_TYPE(instr_refs_map, Addr, CfgInstrRef)
+HASH_MAP_FUNCS(instr_refs_map, Addr, CfgInstrRef, addr_hash_idx, ADDR_EQ,
+		"cgd.cfg.irm.1", CGD_(stat).instr_refs_resizes)
 
-	CfgInstrRef* next;	// Next instruction in block. Nil if last.
+struct _CfgInstrRefs {
+	instr_refs_map map;
 };
 
 struct _CfgCall {
@@ -51,14 +58,18 @@ struct _CfgBlock {
 	Int size;
 
 	struct {
-		CfgInstrRef* leader;
-		CfgInstrRef* tail;
+		UniqueInstr** list;	// contiguous instructions, the leader first
 		Int count;
+		Int capacity;
+		Int base;			// index of the leader in the CFG instruction refs
 	} instrs;
 
 	// CfgBlock can have calls to somewhere.
 	SmartList* calls;		// SmartList<CfgCall*>
 	SmartList* sighandlers;	// SmartList<CfgSignalHandler*>
+#if CALLS_INDEX_THRESHOLD > 0
+	SmartHash* calls_index;	// SmartHash<CfgCall*>, by callee address
+#endif
 
 	Bool indirect;				/* has an indirect call or jump */
 };
@@ -66,8 +77,25 @@ struct _CfgBlock {
 /* CFG hash, resizable */
 cfg_hash cfgs;
 
+#if POOL_ALLOC
+/* Pools of the CFG objects, released in bulk with the CFG hash */
+static struct {
+	PoolAlloc* cfgs;
+	PoolAlloc* nodes;
+	PoolAlloc* edges;
+	PoolAlloc* blocks;
+	PoolAlloc* calls;
+	PoolAlloc* refs;
+} cfg_pools;
+#endif
+
 VgFile *fp = 0;
 
+#if !ENABLE_PROFILING
+/* Instructions of the frozen CFGs, except their entries (--freeze-complete) */
+SmartHash* frozen_instrs = 0;	// SmartHash<UniqueInstr*>
+#endif
+
 struct {
 	enum {
 		TKN_BRACKET_OPEN,
@@ -93,119 +121,207 @@ struct {
 	HChar text[1024];
 } token;
 
-static __inline__
-Addr ref_instr_addr(CfgInstrRef* ref) {
-	CGD_ASSERT(ref != 0 && ref->instr != 0);
-	return ref->instr->addr;
+static
+CfgInstrRefs* new_instr_refs(UInt bits) {
+	CfgInstrRefs* refs;
+
+	refs = (CfgInstrRefs*) CGD_MALLOC("cgd.cfg.nir.1", sizeof(CfgInstrRefs));
+	instr_refs_map_init(&(refs->map), bits);
+
+	return refs;
+}
+
+static
+void delete_instr_refs(CfgInstrRefs* refs) {
+	UInt i;
+
+	CGD_ASSERT(refs != 0);
+
+	instr_refs_map_finish(&(refs->map));
+	for (i = 0; i < refs->map.size; i++) {
+		CfgInstrRef* ref = instr_refs_map_at(&(refs->map), i);
+		if (ref) {
+			CGD_POOL_FREE(cfg_pools.refs, ref, sizeof(CfgInstrRef));
+			refs->map.entries--;
+		}
+	}
+
+	instr_refs_map_destroy(&(refs->map));
+	CGD_DATA_FREE(refs, sizeof(CfgInstrRefs));
 }
 
+// Find the reference of an instruction.
 static __inline__
-CfgInstrRef* new_instr_ref(UniqueInstr* instr) {
+CfgInstrRef* instr_refs_find(CfgInstrRefs* refs, Addr addr) {
+	CGD_ASSERT(addr != 0);
+
+	return instr_refs_map_get(&(refs->map), addr);
+}
+
+// Add the reference of an instruction, or update it if it exists.
+static
+void instr_refs_put(CfgInstrRefs* refs, Addr addr, CfgNode* node, Int index) {
 	CfgInstrRef* ref;
 
-	CGD_ASSERT(instr != 0);
+	CGD_ASSERT(addr != 0);
+	CGD_ASSERT(node != 0);
 
-	ref = (CfgInstrRef*) CGD_MALLOC("cgd.cfg.nil.1", sizeof(CfgInstrRef));
-	VG_(memset)(ref, 0, sizeof(CfgInstrRef));
+	ref = instr_refs_map_get(&(refs->map), addr);
+	if (!ref) {
+		ref = (CfgInstrRef*) CGD_POOL_MALLOC(cfg_pools.refs, "cgd.cfg.irp.1",
+					sizeof(CfgInstrRef));
+		instr_refs_map_put(&(refs->map), addr, ref);
+	}
 
-	ref->instr = instr;
+	ref->node = node;
+	ref->index = index;
+}
 
-	return ref;
+static
+void instr_refs_remove(CfgInstrRefs* refs, Addr addr) {
+	CfgInstrRef* ref;
+
+	CGD_ASSERT(addr != 0);
+
+	ref = instr_refs_map_remove(&(refs->map), addr);
+	CGD_ASSERT(ref != 0);
+
+	CGD_POOL_FREE(cfg_pools.refs, ref, sizeof(CfgInstrRef));
 }
 
+/* The structure of the CFG changed. */
 static __inline__
-void delete_instr_ref(CfgInstrRef* ref) {
-	CGD_ASSERT(ref != 0);
-	CGD_DATA_FREE(ref, sizeof(CfgInstrRef));
+void set_dirty(CFG* cfg) {
+	cfg->dirty = True;
+#if !ENABLE_PROFILING
+	cfg->stable = 0;
+#endif
+}
+
+/* The CFG is as loaded (or checked). */
+static
+void clear_dirty(CFG* cfg) {
+	cfg->dirty = False;
 }
 
+HASH_MAP_FUNCS(cfg_hash, Addr, CFG, addr_hash_idx, ADDR_EQ,
+		"cgd.cfg.ich.1", CGD_(stat).cfg_hash_resizes)
+
 static __inline__
-UInt cfg_hash_idx(Addr addr, UInt size) {
-	return addr % size;
+CFG* lookup_cfg(Addr addr) {
+	CGD_ASSERT(addr != 0);
+	return cfg_hash_get(&cfgs, addr);
 }
 
-/* double size of cfg table  */
 static
-void resize_cfg_table(void) {
-    Int i, new_size, conflicts1 = 0;
-    CFG **new_table, *curr, *next;
-    UInt new_idx;
-
-    new_size  = 2 * cfgs.size + 3;
-    new_table = (CFG**) CGD_MALLOC("cgd.cfg.rct.1",
-                                  (new_size * sizeof(CFG*)));
-    VG_(memset)(new_table, 0, (new_size * sizeof(CFG*)));
-
-    for (i = 0; i < cfgs.size; i++) {
-		if (cfgs.table[i] == 0)
-			continue;
+Bool has_cfg_node(CFG* cfg, CfgNode* node) {
+	CGD_ASSERT(cfg != 0);
+	CGD_ASSERT(node != 0);
 
-		curr = cfgs.table[i];
-		while (curr != 0) {
-			next = curr->chain;
+	return node->idx >= 0 && node->idx < CGD_(smart_list_count)(cfg->nodes) &&
+		CGD_(smart_list_at)(cfg->nodes, node->idx) == node;
+}
 
-			new_idx = cfg_hash_idx(curr->addr, new_size);
+// Nodes and edges keep their positions in the lists that hold them,
+// so they can be removed in constant time by swapping with the tail.
+static __inline__
+void cfg_add_node(CFG* cfg, CfgNode* node) {
+	node->idx = CGD_(smart_list_count)(cfg->nodes);
+	CGD_(smart_list_add)(cfg->nodes, node);
+}
 
-			curr->chain = new_table[new_idx];
-			new_table[new_idx] = curr;
-			if (curr->chain)
-				conflicts1++;
+static
+void cfg_remove_node(CFG* cfg, CfgNode* node) {
+	Int last;
 
-			curr = next;
-		}
-    }
+	CGD_ASSERT(has_cfg_node(cfg, node));
 
-    CGD_FREE(cfgs.table);
+	last = CGD_(smart_list_count)(cfg->nodes) - 1;
+	if (node->idx < last) {
+		CfgNode* moved = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, last);
+		CGD_(smart_list_set)(cfg->nodes, node->idx, moved);
+		moved->idx = node->idx;
+	}
+	CGD_(smart_list_set)(cfg->nodes, last, 0);
 
-    CGD_DEBUG(0, "Resize CFG Hash: %u => %d (entries %u, conflicts %d)\n",
-	     cfgs.size, new_size,
-	     cfgs.entries, conflicts1);
+	node->idx = -1;
+}
 
-    cfgs.size  = new_size;
-    cfgs.table = new_table;
-    CGD_(stat).cfg_hash_resizes++;
+static __inline__
+void edge_list_add(SmartList* list, CfgEdge* edge, enum CfgEdgeList which) {
+	edge->idx[which] = CGD_(smart_list_count)(list);
+	CGD_(smart_list_add)(list, edge);
 }
 
 static
-CFG* lookup_cfg(Addr addr) {
-	CFG* cfg;
-	Int idx;
+void edge_list_remove(SmartList* list, CfgEdge* edge, enum CfgEdgeList which) {
+	Int last;
 
-	CGD_ASSERT(addr != 0);
+	CGD_ASSERT(edge->idx[which] >= 0);
+	CGD_ASSERT(CGD_(smart_list_at)(list, edge->idx[which]) == edge);
 
-	idx = cfg_hash_idx(addr, cfgs.size);
-	cfg = cfgs.table[idx];
+	last = CGD_(smart_list_count)(list) - 1;
+	if (edge->idx[which] < last) {
+		CfgEdge* moved = (CfgEdge*) CGD_(smart_list_at)(list, last);
+		CGD_(smart_list_set)(list, edge->idx[which], moved);
+		moved->idx[which] = edge->idx[which];
+	}
+	CGD_(smart_list_set)(list, last, 0);
 
-	while (cfg) {
-		if (cfg->addr == addr)
-			break;
+	edge->idx[which] = -1;
+}
 
-		cfg = cfg->chain;
-	}
+#if SUCC_INDEX_THRESHOLD > 0
+static
+HWord edge_dst_addr(CfgEdge* edge) {
+	CGD_ASSERT(edge != 0);
+	return CGD_(cfgnode_addr)(edge->dst);
+}
 
-	return cfg;
+// Only edges to blocks and phantoms have an address to be indexed by.
+static __inline__
+Bool is_indexed_edge(CfgEdge* edge) {
+	return edge->dst->type == CFG_BLOCK || edge->dst->type == CFG_PHANTOM;
 }
 
+// (Re)build the successors index of a node if it has enough successors.
 static
-Bool has_cfg_node(CFG* cfg, CfgNode* node) {
+void rebuild_succ_index(CfgNode* node) {
 	Int i, count;
 
-	CGD_ASSERT(cfg != 0);
 	CGD_ASSERT(node != 0);
 
-	count = CGD_(smart_list_count)(cfg->nodes);
+	if (node->info.succ_index) {
+		CGD_(delete_smart_hash)(node->info.succ_index);
+		node->info.succ_index = 0;
+	}
+
+	count = node->info.successors ?
+			CGD_(smart_list_count)(node->info.successors) : 0;
+	if (count < SUCC_INDEX_THRESHOLD)
+		return;
+
+	node->info.succ_index = CGD_(new_smart_hash)((2 * count) + 1);
 	for (i = 0; i < count; i++) {
-		CfgNode* tmp = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
-		CGD_ASSERT(tmp != 0);
+		CfgEdge* edge = (CfgEdge*) CGD_(smart_list_at)(node->info.successors, i);
+		CGD_ASSERT(edge != 0);
 
-		if (CGD_(cfgnodes_cmp)(node, tmp))
-			return True;
+		if (is_indexed_edge(edge))
+			CGD_(smart_hash_put)(node->info.succ_index, edge,
+					(HWord (*)(void*)) edge_dst_addr);
 	}
 
-	// Not found.
-	return False;
+	CGD_(stat).succ_indexes++;
 }
 
+static __inline__
+CfgEdge* find_indexed_edge(CfgNode* node, Addr addr) {
+	CGD_ASSERT(node->info.succ_index != 0);
+	return (CfgEdge*) CGD_(smart_hash_get)(node->info.succ_index,
+				addr, (HWord (*)(void*)) edge_dst_addr);
+}
+#endif
+
 static
 CfgEdge* find_edge(CfgNode* src, CfgNode* dst) {
 	Int i, count;
@@ -213,6 +329,14 @@ CfgEdge* find_edge(CfgNode* src, CfgNode* dst) {
 	CGD_ASSERT(src != 0 && (src->type != CFG_EXIT && src->type != CFG_HALT));
 	CGD_ASSERT(dst != 0 && dst->type != CFG_ENTRY);
 
+#if SUCC_INDEX_THRESHOLD > 0
+	if (src->info.succ_index &&
+		(dst->type == CFG_BLOCK || dst->type == CFG_PHANTOM)) {
+		CfgEdge* edge = find_indexed_edge(src, CGD_(cfgnode_addr)(dst));
+		return (edge && CGD_(cfgnodes_cmp)(dst, edge->dst)) ? edge : 0;
+	}
+#endif
+
 	CGD_ASSERT(src->info.successors != 0);
 	count = CGD_(smart_list_count)(src->info.successors);
 	for (i = 0; i < count; i++) {
@@ -228,6 +352,31 @@ CfgEdge* find_edge(CfgNode* src, CfgNode* dst) {
 	return 0;
 }
 
+#if CALLS_INDEX_THRESHOLD > 0
+static
+HWord cfgcall_addr(CfgCall* cfgCall) {
+	CGD_ASSERT(cfgCall != 0);
+	return cfgCall->called->addr;
+}
+
+// Build the calls index of a block that has enough calls.
+static
+void build_calls_index(CfgBlock* block) {
+	Int i, count;
+
+	CGD_ASSERT(block != 0);
+	CGD_ASSERT(block->calls_index == 0);
+
+	count = CGD_(smart_list_count)(block->calls);
+	block->calls_index = CGD_(new_smart_hash)((2 * count) + 1);
+	for (i = 0; i < count; i++)
+		CGD_(smart_hash_put)(block->calls_index,
+			CGD_(smart_list_at)(block->calls, i), (HWord (*)(void*)) cfgcall_addr);
+
+	CGD_(stat).calls_indexes++;
+}
+#endif
+
 static
 CfgCall* find_call(CfgNode* node, CFG* call) {
 	Int i, count;
@@ -235,6 +384,14 @@ CfgCall* find_call(CfgNode* node, CFG* call) {
 	CGD_ASSERT(node != 0);
 	CGD_ASSERT(node->type == CFG_BLOCK);
 
+#if CALLS_INDEX_THRESHOLD > 0
+	if (node->data.block->calls_index) {
+		CfgCall* tmp = (CfgCall*) CGD_(smart_hash_get)(node->data.block->calls_index,
+							call->addr, (HWord (*)(void*)) cfgcall_addr);
+		return (tmp && CGD_(cfg_cmp)(tmp->called, call)) ? tmp : 0;
+	}
+#endif
+
 	if (node->data.block->calls) {
 		count = CGD_(smart_list_count)(node->data.block->calls);
 		for (i = 0; i < count; i++) {
@@ -256,6 +413,12 @@ CfgCall* find_call_with_addr(CfgNode* node, Addr addr) {
 	CGD_ASSERT(node != 0 && node->type == CFG_BLOCK);
 	CGD_ASSERT(addr != 0);
 
+#if CALLS_INDEX_THRESHOLD > 0
+	if (node->data.block->calls_index)
+		return (CfgCall*) CGD_(smart_hash_get)(node->data.block->calls_index,
+					addr, (HWord (*)(void*)) cfgcall_addr);
+#endif
+
 	if (node->data.block->calls) {
 		size = CGD_(smart_list_count)(node->data.block->calls);
 		for (i = 0; i < size; i++) {
@@ -299,6 +462,13 @@ CfgNode* find_successor_with_addr(CfgNode* node, Addr addr) {
 	CGD_ASSERT(node != 0);
 	CGD_ASSERT(addr != 0);
 
+#if SUCC_INDEX_THRESHOLD > 0
+	if (node->info.succ_index) {
+		CfgEdge* edge = find_indexed_edge(node, addr);
+		return edge ? edge->dst : 0;
+	}
+#endif
+
 	size = CGD_(smart_list_count)(node->info.successors);
 	for (i = 0; i < size; i++) {
 		CfgEdge* edge;
@@ -328,10 +498,10 @@ Bool add_node2cfg(CFG* cfg, CfgNode* node) {
 				   node->type == CFG_PHANTOM);
 
 		// Add the node to the list of nodes in the CFG.
-		CGD_(smart_list_add)(cfg->nodes, node);
+		cfg_add_node(cfg, node);
 
 		// Mark the CFG as dirty.
-		cfg->dirty = True;
+		set_dirty(cfg);
 
 		return True;
 	}
@@ -351,34 +521,41 @@ Bool add_edge2nodes(CFG* cfg, CfgNode* src, CfgNode* dst) {
 		edge->count += count;
 
 		// Mark the CFG as dirty.
-		cfg->dirty = True;
+		set_dirty(cfg);
 #endif
 
 		return False;
 	}
 
 	// Create the edge.
-	edge = (CfgEdge*) CGD_MALLOC("cgd.cfg.ae2n.1", sizeof(CfgEdge));
-	VG_(memset)(edge, 0, sizeof(edge));
+	edge = (CfgEdge*) CGD_POOL_MALLOC(cfg_pools.edges, "cgd.cfg.ae2n.1", sizeof(CfgEdge));
+	VG_(memset)(edge, 0, sizeof(CfgEdge));
 	edge->src = src;
 	edge->dst = dst;
+
 #if ENABLE_PROFILING
 	edge->count = count;
 #endif
 
-	// Add the edge to the CFG.
-	CGD_(smart_list_add)(cfg->edges, edge);
-
 	// Add the successor.
 	CGD_ASSERT(src->info.successors != 0);
-	CGD_(smart_list_add)(src->info.successors, edge);
+	edge_list_add(src->info.successors, edge, EDGE_SUCC_LIST);
+#if SUCC_INDEX_THRESHOLD > 0
+	if (src->info.succ_index) {
+		if (is_indexed_edge(edge))
+			CGD_(smart_hash_put)(src->info.succ_index, edge,
+					(HWord (*)(void*)) edge_dst_addr);
+	} else if (CGD_(smart_list_count)(src->info.successors) >= SUCC_INDEX_THRESHOLD) {
+		rebuild_succ_index(src);
+	}
+#endif
 
 	// Add the predecessor.
 	CGD_ASSERT(dst->info.predecessors != 0);
-	CGD_(smart_list_add)(dst->info.predecessors, edge);
+	edge_list_add(dst->info.predecessors, edge, EDGE_PRED_LIST);
 
 	// Mark the CFG as dirty.
-	cfg->dirty = True;
+	set_dirty(cfg);
 
 	return True;
 }
@@ -395,12 +572,12 @@ void add_call2node(CFG* cfg, CfgNode* node, CFG* called) {
 		cfgCall->count += count;
 
 		// Mark the CFG as dirty.
-		cfg->dirty = True;
+		set_dirty(cfg);
 #endif
 	} else {
 		CGD_ASSERT(find_successor_with_addr(node, called->addr) == 0);
 
-		cfgCall = (CfgCall*) CGD_MALLOC("cgd.cfg.cac.1", sizeof(CfgCall));
+		cfgCall = (CfgCall*) CGD_POOL_MALLOC(cfg_pools.calls, "cgd.cfg.cac.1", sizeof(CfgCall));
 		VG_(memset)(cfgCall, 0, sizeof(CfgCall));
 		cfgCall->called = called;
 #if ENABLE_PROFILING
@@ -411,9 +588,16 @@ void add_call2node(CFG* cfg, CfgNode* node, CFG* called) {
 			node->data.block->calls = CGD_(new_smart_list)(1);
 
 		CGD_(smart_list_add)(node->data.block->calls, cfgCall);
+#if CALLS_INDEX_THRESHOLD > 0
+		if (node->data.block->calls_index)
+			CGD_(smart_hash_put)(node->data.block->calls_index, cfgCall,
+				(HWord (*)(void*)) cfgcall_addr);
+		else if (CGD_(smart_list_count)(node->data.block->calls) >= CALLS_INDEX_THRESHOLD)
+			build_calls_index(node->data.block);
+#endif
 
 		// Mark the CFG as dirty.
-		cfg->dirty = True;
+		set_dirty(cfg);
 	}
 }
 
@@ -431,14 +615,14 @@ void add_sighandler2node(CFG* cfg, CfgNode* node, CFG* called, Int signum) {
 		sigHandler->handler->count += count;
 
 		// Mark the CFG as dirty.
-		cfg->dirty = True;
+		set_dirty(cfg);
 #endif
 	} else {
 		sigHandler = (CfgSignalHandler*) CGD_MALLOC("cgd.cfg.cssh.1", sizeof(CfgSignalHandler));
 		VG_(memset)(sigHandler, 0, sizeof(CfgSignalHandler));
 
 		sigHandler->signum = signum;
-		sigHandler->handler = (CfgCall*) CGD_MALLOC("cgd.cfg.cssh.2", sizeof(CfgCall));
+		sigHandler->handler = (CfgCall*) CGD_POOL_MALLOC(cfg_pools.calls, "cgd.cfg.cssh.2", sizeof(CfgCall));
 		VG_(memset)(sigHandler->handler, 0, sizeof(CfgCall));
 		sigHandler->handler->called = called;
 
@@ -452,7 +636,7 @@ void add_sighandler2node(CFG* cfg, CfgNode* node, CFG* called, Int signum) {
 		CGD_(smart_list_add)(node->data.block->sighandlers, sigHandler);
 
 		// Mark the CFG as dirty.
-		cfg->dirty = True;
+		set_dirty(cfg);
 	}
 }
 
@@ -462,11 +646,12 @@ CfgNode* new_cfgnode(enum CfgNodeType type, Int succs, Int preds) {
 
 	CGD_ASSERT(succs >= 0);
 
-	node = (CfgNode*) CGD_MALLOC("cgd.cfg.ncn.1", sizeof(CfgNode));
+	node = (CfgNode*) CGD_POOL_MALLOC(cfg_pools.nodes, "cgd.cfg.ncn.1", sizeof(CfgNode));
 	VG_(memset)(node, 0, sizeof(CfgNode));
 
 	node->id = ++CGD_(stat).distinct_cfg_nodes;
 	node->type = type;
+	node->idx = -1;
 
 	if (succs > 0) {
 		node->info.successors = CGD_(new_smart_list)(succs);
@@ -480,39 +665,27 @@ CfgNode* new_cfgnode(enum CfgNodeType type, Int succs, Int preds) {
 }
 
 static __inline__
-CfgBlock* new_block(CfgInstrRef* ref) {
+CfgBlock* new_block(UniqueInstr** instrs, Int count) {
+	Int i;
 	CfgBlock* block;
 
-	CGD_ASSERT(ref != 0);
-	CGD_ASSERT(ref->instr != 0);
+	CGD_ASSERT(instrs != 0);
+	CGD_ASSERT(count > 0);
 
-	block = (CfgBlock*) CGD_MALLOC("cgd.cfg.nb.1", sizeof(CfgBlock));
+	block = (CfgBlock*) CGD_POOL_MALLOC(cfg_pools.blocks, "cgd.cfg.nb.1", sizeof(CfgBlock));
 	VG_(memset)(block, 0,  sizeof(CfgBlock));
 
-	block->addr = ref->instr->addr;
-	block->size = ref->instr->size;
-
-	// Make this instruction the first and last in the block.
-	block->instrs.leader = ref;
-	block->instrs.tail = ref;
-	block->instrs.count = 1;
-
-	// Make all the references in the block orphan of its parent node
-	// PS: It will be fixed later.
-	block->instrs.tail->node = 0;
+	block->addr = instrs[0]->addr;
 
-	// Follow the instructions chain.
-	while (block->instrs.tail->next != 0) {
-		// Find the new tail.
-		block->instrs.tail = block->instrs.tail->next;
+	// Copy the instructions of the block, with some room to append more.
+	block->instrs.capacity = count < 4 ? 4 : count;
+	block->instrs.list = (UniqueInstr**) CGD_MALLOC("cgd.cfg.nb.2",
+				(block->instrs.capacity * sizeof(UniqueInstr*)));
+	VG_(memcpy)(block->instrs.list, instrs, (count * sizeof(UniqueInstr*)));
+	block->instrs.count = count;
 
-		// Account for this new instruction in the block.
-		block->instrs.count++;
-		block->size += block->instrs.tail->instr->size;
-
-		// Make the next one orphan too.
-		block->instrs.tail->node = 0;
-	}
+	for (i = 0; i < count; i++)
+		block->size += instrs[i]->size;
 
 	return block;
 }
@@ -520,7 +693,7 @@ CfgBlock* new_block(CfgInstrRef* ref) {
 static
 void delete_cfgcall(CfgCall* call) {
 	CGD_ASSERT(call != 0);
-	CGD_DATA_FREE(call, sizeof(CfgCall));
+	CGD_POOL_FREE(cfg_pools.calls, call, sizeof(CfgCall));
 }
 
 static
@@ -528,41 +701,38 @@ void delete_cfgsighandler(CfgSignalHandler* sighandler) {
 	CGD_ASSERT(sighandler != 0);
 	CGD_ASSERT(sighandler->handler != 0);
 
-	CGD_DATA_FREE(sighandler->handler, sizeof(CfgCall));
+	CGD_POOL_FREE(cfg_pools.calls, sighandler->handler, sizeof(CfgCall));
 	CGD_DATA_FREE(sighandler, sizeof(CfgSignalHandler));
 }
 
 static
 void delete_block(CfgBlock* block) {
-	CfgInstrRef* ref;
-	CfgInstrRef* next;
-
 	CGD_ASSERT(block != 0);
 
-	ref = block->instrs.leader;
-	while (ref) {
-		next = ref->next;
-		delete_instr_ref(ref);
-		ref = next;
-	}
+	if (block->instrs.list)
+		CGD_DATA_FREE(block->instrs.list, (block->instrs.capacity * sizeof(UniqueInstr*)));
 
 	if (block->calls) {
 		CGD_(smart_list_clear)(block->calls, (void (*)(void*)) delete_cfgcall);
 		CGD_(delete_smart_list)(block->calls);
 	}
 
+#if CALLS_INDEX_THRESHOLD > 0
+	if (block->calls_index)
+		CGD_(delete_smart_hash)(block->calls_index);
+#endif
+
 	if (block->sighandlers) {
 		CGD_(smart_list_clear)(block->sighandlers, (void (*)(void*)) delete_cfgsighandler);
 		CGD_(delete_smart_list)(block->sighandlers);
 	}
 
-	CGD_DATA_FREE(block, sizeof(CfgBlock));
+	CGD_POOL_FREE(cfg_pools.blocks, block, sizeof(CfgBlock));
 }
 
 static
 void cfgnode_put_block(CFG* cfg, CfgNode* node, CfgBlock* block) {
-	CfgInstrRef* ref;
-	CfgInstrRef* old;
+	Int i;
 
 	CGD_ASSERT(cfg != 0);
 	CGD_ASSERT(node != 0);
@@ -572,96 +742,77 @@ void cfgnode_put_block(CFG* cfg, CfgNode* node, CfgBlock* block) {
 	// Add the block to the node.
 	node->data.block = block;
 
-	// Get the first instruction in the block.
-	ref = block->instrs.leader;
-	CGD_ASSERT(ref != 0);
-	CGD_ASSERT(node->data.block->addr == ref->instr->addr);
-
-	// Fix the node in all instructions refs and add them to the cache.
-	while (ref) {
-		// Update the reference node information.
-		CGD_ASSERT(ref->node == 0);
-		ref->node = node;
-
-		// Add the reference to the CFG cache and ensure it should not be another ref
-		// with the same adddress.
-		old = CGD_(smart_hash_put)(cfg->cache.refs, ref, (HWord (*)(void*)) ref_instr_addr);
-		CGD_ASSERT(old == 0 || old == ref);
-
-		ref = ref->next;
-	}
+	// Add the instructions to the CFG cache (or move them to this node).
+	for (i = 0; i < block->instrs.count; i++)
+		instr_refs_put(cfg->cache.refs, block->instrs.list[i]->addr,
+				node, (block->instrs.base + i));
 
 	// Mark the CFG as dirty.
-	cfg->dirty = True;
+	set_dirty(cfg);
 }
 
 static
-void cfgnode_put_phantom(CFG* cfg, CfgNode* node, CfgInstrRef* ref) {
-	CfgInstrRef* old;
-
+void cfgnode_put_phantom(CFG* cfg, CfgNode* node, UniqueInstr* instr) {
 	CGD_ASSERT(cfg != 0);
 	CGD_ASSERT(node != 0);
-	CGD_ASSERT(ref != 0);
+	CGD_ASSERT(instr != 0);
 	CGD_ASSERT(node->data.phantom == 0);
 
-	// Add the block to the node.
-	node->data.phantom = ref;
-	ref->node = node;
-	ref->next = 0;
+	// Add the instruction to the node.
+	node->data.phantom = instr;
 
-	// Add the reference to the CFG cache and ensure it should not be another ref
-	// with the same adddress.
-	old = CGD_(smart_hash_put)(cfg->cache.refs, ref, (HWord (*)(void*)) ref_instr_addr);
-	CGD_ASSERT(old == 0 || old == ref);
+	// Add the instruction to the CFG cache, it should not be there yet.
+	CGD_ASSERT(instr_refs_find(cfg->cache.refs, instr->addr) == 0);
+	instr_refs_put(cfg->cache.refs, instr->addr, node, 0);
 
 	// Mark the CFG as dirty.
-	cfg->dirty = True;
+	set_dirty(cfg);
 }
 
 static
-void add_ref2node(CFG* cfg, CfgNode* node, CfgInstrRef* ref) {
-	CfgInstrRef** last;
-	CfgInstrRef* old;
+void add_instr2node(CFG* cfg, CfgNode* node, UniqueInstr* instr) {
+	CfgBlock* block;
+	UniqueInstr* tail;
 
 	CGD_ASSERT(cfg != 0);
 	CGD_ASSERT(node != 0);
 	CGD_ASSERT(node->type == CFG_BLOCK && node->data.block != 0);
-	CGD_ASSERT(ref != 0);
+	CGD_ASSERT(instr != 0);
 
-	// Get the last instruction reference in the node.
-	last = &(node->data.block->instrs.tail);
-	CGD_ASSERT(*last != 0 && (*last)->next == 0);
-	CGD_ASSERT((*last)->node == node);
-	CGD_ASSERT(((*last)->instr->addr + (*last)->instr->size) == ref->instr->addr);
+	block = node->data.block;
 
-	// Add the last reference.
-	(*last)->next = ref;
-	ref->node = node;
-	ref->next = 0;
-	*last = ref;
+	// It must follow the last instruction in the node.
+	tail = block->instrs.list[block->instrs.count - 1];
+	CGD_ASSERT((tail->addr + tail->size) == instr->addr);
 
-	// Account for the instruction and its size in the block.
-	node->data.block->instrs.count++;
-	node->data.block->size += ref->instr->size;
+	if (block->instrs.count == block->instrs.capacity) {
+		block->instrs.capacity *= 2;
+		block->instrs.list = (UniqueInstr**) CGD_REALLOC("cgd.cfg.ai2n.1",
+					block->instrs.list, (block->instrs.capacity * sizeof(UniqueInstr*)));
+	}
 
-	// Add the reference to the CFG cache and ensure it should not be another ref
-	// with the same adddress.
-	old = CGD_(smart_hash_put)(cfg->cache.refs, ref, (HWord (*)(void*)) ref_instr_addr);
-	CGD_ASSERT(old == 0 || old == ref);
+	// Add the instruction to the CFG cache, it should not be there yet.
+	CGD_ASSERT(instr_refs_find(cfg->cache.refs, instr->addr) == 0);
+	instr_refs_put(cfg->cache.refs, instr->addr, node,
+			(block->instrs.base + block->instrs.count));
+
+	// Account for the instruction and its size in the block.
+	block->instrs.list[block->instrs.count++] = instr;
+	block->size += instr->size;
 
 	// Mark the CFG as dirty.
-	cfg->dirty = True;
+	set_dirty(cfg);
 }
 
 static
-CfgNode* new_cfgnode_block(CFG* cfg, CfgInstrRef* ref) {
+CfgNode* new_cfgnode_block(CFG* cfg, UniqueInstr** instrs, Int count) {
 	CfgNode* node;
 
 	CGD_ASSERT(cfg != 0);
-	CGD_ASSERT(ref != 0);
+	CGD_ASSERT(instrs != 0);
 
 	node = new_cfgnode(CFG_BLOCK, 2, 1);
-	cfgnode_put_block(cfg, node, new_block(ref));
+	cfgnode_put_block(cfg, node, new_block(instrs, count));
 
 	// Add the node to the CFG.
 	add_node2cfg(cfg, node);
@@ -673,14 +824,14 @@ CfgNode* new_cfgnode_block(CFG* cfg, CfgInstrRef* ref) {
 }
 
 static
-CfgNode* new_cfgnode_phantom(CFG* cfg, CfgInstrRef* ref) {
+CfgNode* new_cfgnode_phantom(CFG* cfg, UniqueInstr* instr) {
 	CfgNode* node;
 
 	CGD_ASSERT(cfg != 0);
-	CGD_ASSERT(ref != 0);
+	CGD_ASSERT(instr != 0);
 
 	node = new_cfgnode(CFG_PHANTOM, 0, 1);
-	cfgnode_put_phantom(cfg, node, ref);
+	cfgnode_put_phantom(cfg, node, instr);
 
 	// Add the node to the CFG.
 	add_node2cfg(cfg, node);
@@ -697,10 +848,10 @@ CfgNode* cfgnode_exit(CFG* cfg) {
 
 	if (!cfg->exit) {
 		cfg->exit = new_cfgnode(CFG_EXIT, 0, 1);
-		CGD_(smart_list_add)(cfg->nodes, cfg->exit);
+		cfg_add_node(cfg, cfg->exit);
 
 		// Mark the CFG as dirty.
-		cfg->dirty = True;
+		set_dirty(cfg);
 	}
 
 	return cfg->exit;
@@ -712,53 +863,94 @@ CfgNode* cfgnode_halt(CFG* cfg) {
 
 	if (!cfg->halt) {
 		cfg->halt = new_cfgnode(CFG_HALT, 0, 1);
-		CGD_(smart_list_add)(cfg->nodes, cfg->halt);
+		cfg_add_node(cfg, cfg->halt);
 
 		// Mark the CFG as dirty.
-		cfg->dirty = True;
+		set_dirty(cfg);
 	}
 
 	return cfg->halt;
 }
 
 #if CFG_NODE_CACHE_SIZE > 0
+/*
+ * The functions below return the entry of a node cache where a new
+ * element will be stored, moved to the front of its set: the entry
+ * with the same element if it is still cached, or the least recently
+ * used one of the set otherwise. Pending counts are flushed first.
+ */
 static __inline__
-CfgNodeBlockCache* cfgblock_cache(CfgNode* node, Addr addr) {
+CfgNodeBlockCache* cfgblock_cache(CFG* cfg, CfgNode* node, Addr addr, UInt size) {
+	Int way;
+	CfgNodeBlockCache* set;
+
 	CGD_ASSERT(node != 0);
 
 	if (!node->cache.block) {
-		Int memsize = CFG_NODE_CACHE_SIZE * sizeof(CfgNodeBlockCache);
+		Int memsize = CGD_(clo).node_cache.size * sizeof(CfgNodeBlockCache);
 		node->cache.block = (CfgNodeBlockCache*) CGD_MALLOC("cgd.cfg.cbc.1", memsize);
 		VG_(memset)(node->cache.block, 0, memsize);
 	}
 
-	return &(node->cache.block[CFG_NODE_CACHE_INDEX(addr)]);
-}
+	set = &(node->cache.block[CFG_NODE_CACHE_SET(addr)]);
+	for (way = 0; way < (CGD_(clo).node_cache.ways - 1); way++) {
+		if (set[way].addr == addr && set[way].size == size)
+			break;
+	}
 
-static __inline__
-CfgNodePhantomCache* cfgphantom_cache(CfgNode* node, Addr addr) {
-	CGD_ASSERT(node != 0);
+	if (set[way].addr != 0 &&
+			(set[way].addr != addr || set[way].size != size))
+		CGD_HOT_STAT(CGD_(stat).block_cache.evictions);
+	CGD_HOT_STAT(cfg->stats.cache_misses);
 
-	if (!node->cache.phantom) {
-		Int memsize = CFG_NODE_CACHE_SIZE * sizeof(CfgNodePhantomCache);
-		node->cache.phantom = (CfgNodePhantomCache*) CGD_MALLOC("cgd.cfg.cpc.1", memsize);
-		VG_(memset)(node->cache.phantom, 0, memsize);
+#if ENABLE_PROFILING
+	if (set[way].count > 0) {
+		CGD_(cfgnode_flush_edge_count)(cfg, node, &(set[way]));
+		CGD_HOT_STAT(CGD_(stat).block_cache.flushes);
 	}
+#endif
+
+	if (way > 0)
+		CFG_NODE_CACHE_PROMOTE(CfgNodeBlockCache, set, way);
 
-	return &(node->cache.phantom[CFG_NODE_CACHE_INDEX(addr)]);
+	return set;
 }
 
 static __inline__
-CfgNodeCallCache* cfgcall_cache(CfgNode* node, Addr addr) {
+CfgNodeCallCache* cfgcall_cache(CFG* cfg, CfgNode* node, CFG* called, Bool indirect) {
+	Int way;
+	CfgNodeCallCache* set;
+
 	CGD_ASSERT(node != 0);
 
 	if (!node->cache.call) {
-		Int memsize = CFG_NODE_CACHE_SIZE * sizeof(CfgNodeCallCache);
+		Int memsize = CGD_(clo).node_cache.size * sizeof(CfgNodeCallCache);
 		node->cache.call = (CfgNodeCallCache*) CGD_MALLOC("cgd.cfg.ccc.1", memsize);
 		VG_(memset)(node->cache.call, 0, memsize);
 	}
 
-	return &(node->cache.call[CFG_NODE_CACHE_INDEX(addr)]);
+	set = &(node->cache.call[CFG_NODE_CACHE_SET(called->addr)]);
+	for (way = 0; way < (CGD_(clo).node_cache.ways - 1); way++) {
+		if (set[way].called == called && set[way].indirect == indirect)
+			break;
+	}
+
+	if (set[way].called != 0 &&
+			(set[way].called != called || set[way].indirect != indirect))
+		CGD_HOT_STAT(CGD_(stat).call_cache.evictions);
+	CGD_HOT_STAT(cfg->stats.cache_misses);
+
+#if ENABLE_PROFILING
+	if (set[way].count > 0) {
+		CGD_(cfgnode_flush_call_count)(cfg, node, &(set[way]));
+		CGD_HOT_STAT(CGD_(stat).call_cache.flushes);
+	}
+#endif
+
+	if (way > 0)
+		CFG_NODE_CACHE_PROMOTE(CfgNodeCallCache, set, way);
+
+	return set;
 }
 #endif
 
@@ -770,9 +962,6 @@ void delete_cfgnode(CfgNode* node) {
 		case CFG_BLOCK:
 			delete_block(node->data.block);
 			break;
-		case CFG_PHANTOM:
-			delete_instr_ref(node->data.phantom);
-			break;
 		default:
 			break;
 	}
@@ -782,116 +971,87 @@ void delete_cfgnode(CfgNode* node) {
 		CGD_(delete_smart_list)(node->info.successors);
 	}
 
+#if SUCC_INDEX_THRESHOLD > 0
+	if (node->info.succ_index)
+		CGD_(delete_smart_hash)(node->info.succ_index);
+#endif
+
 	if (node->info.predecessors) {
 		CGD_(smart_list_clear)(node->info.predecessors, 0);
 		CGD_(delete_smart_list)(node->info.predecessors);
 	}
 
+	if (node->info.exits) {
+		CGD_(smart_list_clear)(node->info.exits, 0);
+		CGD_(delete_smart_list)(node->info.exits);
+	}
+
 #if CFG_NODE_CACHE_SIZE > 0
 	if (node->cache.block)
 		CGD_FREE(node->cache.block);
 
-	if (node->cache.phantom)
-		CGD_FREE(node->cache.phantom);
-
 	if (node->cache.call)
 		CGD_FREE(node->cache.call);
 #endif
 
-	CGD_DATA_FREE(node, sizeof(CfgNode));
+	CGD_POOL_FREE(cfg_pools.nodes, node, sizeof(CfgNode));
 }
 
 static
 void delete_cfgedge(CfgEdge* edge) {
 	CGD_ASSERT(edge != 0);
 
-	CGD_DATA_FREE(edge, sizeof(CfgEdge));
+	CGD_POOL_FREE(cfg_pools.edges, edge, sizeof(CfgEdge));
 }
 
+// Position of the referenced instruction in its block.
 static __inline__
-Bool ref_is_head(CfgInstrRef* ref) {
+Int ref_block_pos(CfgInstrRef* ref) {
 	CGD_ASSERT(ref && ref->node && ref->node->type == CFG_BLOCK);
-	return ref == ref->node->data.block->instrs.leader;
+	return ref->index - ref->node->data.block->instrs.base;
+}
+
+static __inline__
+Bool ref_is_head(CfgInstrRef* ref) {
+	return ref_block_pos(ref) == 0;
 }
 
 static
 Bool remove_edge(CFG* cfg, CfgNode* src, CfgNode* dst) {
-	Int i, size;
+	CfgEdge* edge;
 
 	CGD_ASSERT(cfg != 0);
 	CGD_ASSERT(src != 0);
 	CGD_ASSERT(dst != 0);
 
-	size = CGD_(smart_list_count)(cfg->edges);
-	for (i = 0; i < size; i++) {
-		CfgEdge* edge = (CfgEdge*) CGD_(smart_list_at)(cfg->edges, i);
-		CGD_ASSERT(edge != 0);
-
-		if (CGD_(cfgnodes_cmp)(edge->src, src) &&
-			CGD_(cfgnodes_cmp)(edge->dst, dst)) {
-			Int j, size2;
-			CfgEdge* last;
+	edge = find_edge(src, dst);
+	if (!edge)
+		return False;
 
 #if ENABLE_PROFILING
-			// This edge can only be removed if it was never executed.
-			CGD_ASSERT(edge->count == 0);
+	// This edge can only be removed if it was never executed.
+	CGD_ASSERT(edge->count == 0);
 #endif
 
-			// Remove from the successors list.
-			size2 = CGD_(smart_list_count)(src->info.successors);
-			for (j = 0; j < size2; j++) {
-				CfgEdge* succ_edge = (CfgEdge*)
-							CGD_(smart_list_at)(src->info.successors, j);
-				CGD_ASSERT(succ_edge != 0);
+	// Remove from the successors list.
+	edge_list_remove(src->info.successors, edge, EDGE_SUCC_LIST);
 
-				if (CGD_(cfgnodes_cmp)(succ_edge->dst, dst)) {
-					CGD_ASSERT(succ_edge == edge);
-
-					last = CGD_(smart_list_at)(src->info.successors, (size2 - 1));
-					CGD_(smart_list_set)(src->info.successors, j, last);
-					CGD_(smart_list_set)(src->info.successors, (size2 - 1), 0);
-
-					break;
-				}
-			}
-			CGD_ASSERT(j < size2); // Did we find it?
-
-			// Remove from the predecessors list.
-			size2 = CGD_(smart_list_count)(dst->info.predecessors);
-			for (j = 0; j < size2; j++) {
-				CfgEdge* pred_edge = (CfgEdge*)
-							CGD_(smart_list_at)(dst->info.predecessors, j);
-				CGD_ASSERT(pred_edge != 0);
-
-				if (CGD_(cfgnodes_cmp)(pred_edge->src, src)) {
-					CGD_ASSERT(pred_edge == edge);
-
-					last = CGD_(smart_list_at)(dst->info.predecessors, (size2 - 1));
-					CGD_(smart_list_set)(dst->info.predecessors, j, last);
-					CGD_(smart_list_set)(dst->info.predecessors, (size2 - 1), 0);
-
-					break;
-				}
-			}
-			CGD_ASSERT(j < size2); // Did we find it?
+#if SUCC_INDEX_THRESHOLD > 0
+	if (src->info.succ_index && is_indexed_edge(edge))
+		CGD_(smart_hash_remove)(src->info.succ_index,
+			edge_dst_addr(edge), (HWord (*)(void*)) edge_dst_addr);
+#endif
 
-			// Remove from the cfg edges.
-			last = (CfgEdge*) CGD_(smart_list_at)(cfg->edges, (size - 1));
-			CGD_(smart_list_set)(cfg->edges, i, last);
-			CGD_(smart_list_set)(cfg->edges, (size - 1), 0);
+	// Remove from the predecessors list.
+	edge_list_remove(dst->info.predecessors, edge, EDGE_PRED_LIST);
 
-			return True;
-		}
-	}
+	delete_cfgedge(edge);
 
-	return False;
+	return True;
 }
 
 static
 void remove_phantom(CFG* cfg, CfgNode* phantom) {
-	CfgInstrRef* ref;
-	SmartValue* pos;
-
 	// We can only remove phantom nodes.
 	CGD_ASSERT(phantom != 0);
 	CGD_ASSERT(phantom->type == CFG_PHANTOM);
@@ -910,19 +1070,11 @@ void remove_phantom(CFG* cfg, CfgNode* phantom) {
 	}
 
 	// Free the node's memory.
-	pos = CGD_(smart_list_find)(cfg->nodes,
-			(Bool (*)(void*, void*)) CGD_(cfgnodes_cmp), phantom);
-	CGD_ASSERT(pos != 0 && pos->next == 0);
-	CGD_(smart_list_set)(cfg->nodes, pos->index, CGD_(smart_list_tail)(cfg->nodes));
-	CGD_(smart_list_set)(cfg->nodes, CGD_(smart_list_count)(cfg->nodes) - 1, 0);
-	CGD_(smart_list_delete_value)(pos);
-
-	ref = phantom->data.phantom;
-	CGD_ASSERT(ref != 0);
+	cfg_remove_node(cfg, phantom);
 
 	// Remove the reference from the CFG's instruction cache.
-	CGD_(smart_hash_remove)(cfg->cache.refs, ref_instr_addr(ref),
-			(HWord (*)(void*)) ref_instr_addr);
+	CGD_ASSERT(phantom->data.phantom != 0);
+	instr_refs_remove(cfg->cache.refs, phantom->data.phantom->addr);
 
 	delete_cfgnode(phantom);
 
@@ -935,47 +1087,37 @@ CfgInstrRef* cfg_instr_find(CFG* cfg, Addr addr) {
 	CGD_ASSERT(cfg != 0);
 	CGD_ASSERT(addr != 0);
 
-	return (CfgInstrRef*) CGD_(smart_hash_get)(cfg->cache.refs,
-				addr, (HWord (*)(void*)) ref_instr_addr);
+	return instr_refs_find(cfg->cache.refs, addr);
 }
 
+// Split the block node before the instruction in position pos,
+// returning the new predecessor node with the instructions before it.
 static
-CfgNode* cfgnode_split(CFG* cfg, CfgInstrRef* ref) {
+CfgNode* cfgnode_split(CFG* cfg, CfgNode* node, Int pos) {
 	Int i, size;
 #if ENABLE_PROFILING
 	ULong count;
 #endif
-	CfgNode* node;
+	CfgBlock* block;
 	CfgNode* pred;
-	CfgInstrRef* first;
-	CfgInstrRef* last;
 
 	CGD_ASSERT(cfg != 0);
-	CGD_ASSERT(ref != 0);
-
-	node = ref->node;
-	CGD_ASSERT(!ref_is_head(ref));
+	CGD_ASSERT(node != 0 && node->type == CFG_BLOCK);
 
-	first = last = node->data.block->instrs.leader;
-	while (last->next != ref) {
-		// Account for the removal of the current instruction
-		// (last at this iteration).
-		node->data.block->size -= last->instr->size;
-		node->data.block->instrs.count--;
+	block = node->data.block;
+	CGD_ASSERT(pos > 0 && pos < block->instrs.count);
 
-		last = last->next;
-		CGD_ASSERT(last != 0);
-	}
+	// Create a new predecessor node with the instructions before pos.
+	pred = new_cfgnode_block(cfg, block->instrs.list, pos);
 
-	// Update the node with the new leader.
-	node->data.block->addr = ref->instr->addr;
-	node->data.block->size -= last->instr->size;
-	node->data.block->instrs.leader = ref;
-	node->data.block->instrs.count--;
-
-	// Create a new predecessor node with the first reference until the last.
-	last->next = 0;
-	pred = new_cfgnode_block(cfg, first);
+	// Update the node with the new leader. The references of its
+	// remaining instructions are kept valid by moving the base.
+	block->addr = block->instrs.list[pos]->addr;
+	block->size -= pred->data.block->size;
+	block->instrs.count -= pos;
+	block->instrs.base += pos;
+	VG_(memmove)(block->instrs.list, (block->instrs.list + pos),
+			(block->instrs.count * sizeof(UniqueInstr*)));
 
 	// The predecessor has naturally a fallthrough to the node.
 	pred->info.has_fallthrough = True;
@@ -995,11 +1137,13 @@ CfgNode* cfgnode_split(CFG* cfg, CfgInstrRef* ref) {
 #if ENABLE_PROFILING
 		count += edge->count;
 #endif
-		CGD_(smart_list_add)(pred->info.predecessors, edge);
+		edge_list_add(pred->info.predecessors, edge, EDGE_PRED_LIST);
 		CGD_(smart_list_set)(node->info.predecessors, i, 0);
 	}
 
 	// Finally, connect both nodes.
+	// The moved edges keep their index keys in the successors index
+	// of their sources, since the predecessor took over the old address.
 	CGD_ASSERT(CGD_(smart_list_count)(node->info.predecessors) == 0);
 #if ENABLE_PROFILING
 	add_edge2nodes(cfg, pred, node, count);
@@ -1017,19 +1161,18 @@ CFG* new_cfg(Addr addr) {
 
 	CGD_ASSERT(addr != 0);
 
-	cfg = (CFG*) CGD_MALLOC("cgd.cfg.nc.1", sizeof(CFG));
+	cfg = (CFG*) CGD_POOL_MALLOC(cfg_pools.cfgs, "cgd.cfg.nc.1", sizeof(CFG));
 	VG_(memset)(cfg, 0, sizeof(CFG));
 
 	cfg->addr = addr;
 
 	// Create the nodes list.
 	cfg->nodes = CGD_(new_smart_list)(3);
-	cfg->edges = CGD_(new_smart_list)(3);
 
 	cfg->entry = new_cfgnode(CFG_ENTRY, 1, 0);
-	CGD_(smart_list_add)(cfg->nodes, cfg->entry);
+	cfg_add_node(cfg, cfg->entry);
 
-	cfg->cache.refs = CGD_(new_smart_hash)(137);
+	cfg->cache.refs = new_instr_refs(5);
 
 	CGD_(stat).distinct_cfgs++;
 
@@ -1038,72 +1181,96 @@ CFG* new_cfg(Addr addr) {
 
 static
 void delete_cfg(CFG* cfg) {
+	Int i, size;
+
 	CGD_ASSERT(cfg != 0);
 
 	if (cfg->fdesc)
 		CGD_(delete_fdesc)(cfg->fdesc);
 
-	CGD_(smart_list_clear)(cfg->edges, (void (*)(void*)) delete_cfgedge);
-	CGD_(delete_smart_list)(cfg->edges);
+	// Every edge is held by the successors of its source.
+	size = CGD_(smart_list_count)(cfg->nodes);
+	for (i = 0; i < size; i++) {
+		CfgNode* node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
+		CGD_ASSERT(node != 0);
+
+		if (node->info.successors)
+			CGD_(smart_list_clear)(node->info.successors,
+					(void (*)(void*)) delete_cfgedge);
+	}
 
 	CGD_(smart_list_clear)(cfg->nodes, (void (*)(void*)) delete_cfgnode);
 	CGD_(delete_smart_list)(cfg->nodes);
 
-	CGD_(smart_hash_clear)(cfg->cache.refs, 0);
-	CGD_(delete_smart_hash)(cfg->cache.refs);
+	delete_instr_refs(cfg->cache.refs);
 
-	CGD_DATA_FREE(cfg, sizeof(CFG));
+	CGD_POOL_FREE(cfg_pools.cfgs, cfg, sizeof(CFG));
 }
 
 void CGD_(init_cfg_hash)() {
-	Int size;
-
-	cfgs.size    = 2137;
-	cfgs.entries = 0;
-
-	size = cfgs.size * sizeof(CFG*);
-	cfgs.table = (CFG**) CGD_MALLOC("cgd.cfg.ich.1", size);
-	VG_(memset)(cfgs.table, 0, size);
+	cfg_hash_init(&cfgs, 12);
+
+#if POOL_ALLOC
+	cfg_pools.cfgs = VG_(newPA)(sizeof(CFG), 256,
+				VG_(malloc), "cgd.cfg.ich.2", VG_(free));
+	cfg_pools.nodes = VG_(newPA)(sizeof(CfgNode), 1024,
+				VG_(malloc), "cgd.cfg.ich.3", VG_(free));
+	cfg_pools.edges = VG_(newPA)(sizeof(CfgEdge), 1024,
+				VG_(malloc), "cgd.cfg.ich.4", VG_(free));
+	cfg_pools.blocks = VG_(newPA)(sizeof(CfgBlock), 1024,
+				VG_(malloc), "cgd.cfg.ich.5", VG_(free));
+	cfg_pools.calls = VG_(newPA)(sizeof(CfgCall), 256,
+				VG_(malloc), "cgd.cfg.ich.7", VG_(free));
+	cfg_pools.refs = VG_(newPA)(sizeof(CfgInstrRef), 1024,
+				VG_(malloc), "cgd.cfg.ich.8", VG_(free));
+#endif
 }
 
 void CGD_(destroy_cfg_hash)() {
-	Int i;
+	UInt i;
 
+#if !ENABLE_PROFILING
+	// Its instructions belong to the instructions pool.
+	if (frozen_instrs) {
+		CGD_(smart_hash_clear)(frozen_instrs, 0);
+		CGD_(delete_smart_hash)(frozen_instrs);
+		frozen_instrs = 0;
+	}
+#endif
+
+	cfg_hash_finish(&cfgs);
 	for (i = 0; i < cfgs.size; i++) {
-		CFG* cfg = cfgs.table[i];
-		while (cfg) {
-			CFG* next = cfg->chain;
+		CFG* cfg = cfg_hash_at(&cfgs, i);
+		if (cfg) {
 			delete_cfg(cfg);
-			cfg = next;
-
 			cfgs.entries--;
 		}
 	}
 
-	CGD_ASSERT(cfgs.entries == 0);
-
-	CGD_FREE(cfgs.table);
-	cfgs.table = 0;
+	cfg_hash_destroy(&cfgs);
+
+#if POOL_ALLOC
+	// Release the pools memory at once.
+	VG_(deletePA)(cfg_pools.cfgs);
+	VG_(deletePA)(cfg_pools.nodes);
+	VG_(deletePA)(cfg_pools.edges);
+	VG_(deletePA)(cfg_pools.blocks);
+	VG_(deletePA)(cfg_pools.calls);
+	VG_(deletePA)(cfg_pools.refs);
+	VG_(memset)(&cfg_pools, 0, sizeof(cfg_pools));
+#endif
 }
 
 CFG* CGD_(get_cfg)(Addr addr) {
 	CFG* cfg;
-	UInt idx;
 
 	cfg = lookup_cfg(addr);
 	if (!cfg) {
-		/* check fill degree of bb hash table and resize if needed (>80%) */
-		cfgs.entries++;
-		if (10 * cfgs.entries / cfgs.size > 8)
-			resize_cfg_table();
-
 		// Create the cfg.
 		cfg = new_cfg(addr);
 
 		/* insert into cfg hash table */
-		idx = cfg_hash_idx(addr, cfgs.size);
-		cfg->chain = cfgs.table[idx];
-		cfgs.table[idx] = cfg;
+		cfg_hash_put(&cfgs, addr, cfg);
 	}
 
 	return cfg;
@@ -1127,6 +1294,13 @@ void CGD_(cfg_build_fdesc)(CFG* cfg) {
 	cfg->fdesc = CGD_(new_fdesc)(cfg->addr, True);
 }
 
+#if CFG_NODE_CACHE_SIZE > 0
+ULong CGD_(cfg_cache_misses)(CFG* cfg) {
+	CGD_ASSERT(cfg != 0);
+	return cfg->stats.cache_misses;
+}
+#endif
+
 static
 void mark_indirect(CFG* cfg, CfgNode* node) {
 	CGD_ASSERT(cfg != 0);
@@ -1145,21 +1319,122 @@ Bool CGD_(cfg_is_dirty)(CFG* cfg) {
 	return cfg->dirty;
 }
 
-Bool CGD_(cfg_is_visited)(CFG* cfg) {
-	CGD_ASSERT(cfg != 0);
-	return cfg->visited;
+Bool CGD_(cfg_is_visited)(CFG* cfg) {
+	CGD_ASSERT(cfg != 0);
+	return cfg->visited;
+}
+
+void CGD_(cfg_set_visited)(CFG* cfg, Bool visited) {
+	CGD_ASSERT(cfg != 0);
+	cfg->visited = visited;
+}
+
+static
+Bool exit_is_deferred_phantom(CFG* cfg, CfgNode* working, Addr to) {
+	return !find_call_with_addr(working, to) && !cfg_instr_find(cfg, to);
+}
+
+/*
+ * The exits recorded to addresses that were not in the CFG are counted
+ * as phantoms until they are materialized. Count them again, since
+ * some of these addresses may have been executed in the meantime.
+ */
+static
+void cfg_recount_deferred(CFG* cfg) {
+	Int i, j, size, count, deferred;
+
+	deferred = 0;
+	size = CGD_(smart_list_count)(cfg->nodes);
+	for (i = 0; i < size; i++) {
+		CfgNode* node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
+		if (!node->info.exits)
+			continue;
+
+		count = CGD_(smart_list_count)(node->info.exits);
+		for (j = 0; j < count; j++) {
+			if (exit_is_deferred_phantom(cfg, node,
+					(Addr) CGD_(smart_list_at)(node->info.exits, j)))
+				deferred++;
+		}
+	}
+
+	cfg->stats.phantoms -= cfg->stats.deferred - deferred;
+	cfg->stats.deferred = deferred;
+}
+
+Bool CGD_(cfg_is_complete)(CFG* cfg) {
+	CGD_ASSERT(cfg != 0);
+
+	if (cfg->stats.deferred > 0)
+		cfg_recount_deferred(cfg);
+
+	return cfg->stats.indirects == 0 &&
+		   cfg->stats.phantoms == 0;
+}
+
+#if !ENABLE_PROFILING
+/*
+ * Stop instrumenting the body of the CFG: its instructions are marked as
+ * frozen and their translations discarded, so they are instrumented again
+ * without the setup_bb call. Its entry still calls setup_bb.
+ */
+static
+void freeze_cfg(CFG* cfg) {
+	Int i, j, size;
+	CfgNode* node;
+
+	CGD_ASSERT(!cfg->frozen);
+	cfg->frozen = True;
+
+	if (!frozen_instrs)
+		frozen_instrs = CGD_(new_smart_hash)(2137);
+
+	size = CGD_(smart_list_count)(cfg->nodes);
+	for (i = 0; i < size; i++) {
+		node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
+		if (node->type != CFG_BLOCK)
+			continue;
+
+		for (j = 0; j < node->data.block->instrs.count; j++) {
+			UniqueInstr* instr = node->data.block->instrs.list[j];
+			if (instr->addr != cfg->addr)
+				CGD_(smart_hash_put)(frozen_instrs, instr, (HWord (*)(void*)) CGD_(instr_addr));
+		}
+
+		CGD_(discard_frozen_translations)(node->data.block->addr, node->data.block->size);
+	}
+
+	CGD_(stat).frozen_cfgs++;
+}
+
+/*
+ * Called on each execution of the CFG: with --freeze-complete, it is
+ * frozen once it is complete and its structure did not change for the
+ * last --freeze-after executions.
+ */
+void CGD_(cfg_entered)(CFG* cfg) {
+	CGD_ASSERT(cfg != 0);
+
+	if (!CGD_(clo).freeze.complete || cfg->frozen ||
+			++cfg->stable < CGD_(clo).freeze.after)
+		return;
+
+	// The exits recorded to new addresses count as phantoms.
+	if (CGD_(cfg_is_complete)(cfg))
+		freeze_cfg(cfg);
+	else
+		cfg->stable = 0;
 }
 
-void CGD_(cfg_set_visited)(CFG* cfg, Bool visited) {
-	CGD_ASSERT(cfg != 0);
-	cfg->visited = visited;
+Bool CGD_(cfg_has_instr)(CFG* cfg, Addr addr) {
+	return cfg_instr_find(cfg, addr) != 0;
 }
 
-Bool CGD_(cfg_is_complete)(CFG* cfg) {
-	CGD_ASSERT(cfg != 0);
-	return cfg->stats.indirects == 0 &&
-		   cfg->stats.phantoms == 0;
+Bool CGD_(cfg_instr_is_frozen)(Addr addr) {
+	return frozen_instrs != 0 &&
+		CGD_(smart_hash_contains)(frozen_instrs, addr, (HWord (*)(void*)) CGD_(instr_addr));
 }
+#endif
 
 CfgNode* CGD_(cfg_entry_node)(CFG* cfg) {
 	CGD_ASSERT(cfg != 0);
@@ -1220,7 +1495,7 @@ Addr CGD_(cfgnode_addr)(CfgNode* node) {
 		case CFG_BLOCK:
 			return node->data.block->addr;
 		case CFG_PHANTOM:
-			return node->data.phantom->instr->addr;
+			return node->data.phantom->addr;
 		default:
 			tl_assert(0);
 			return 0;
@@ -1329,31 +1604,34 @@ static __inline__
 CfgEdge* get_succ_edge(CFG* cfg, CfgNode* from, Addr addr) {
 	Int i, size;
 
+#if SUCC_INDEX_THRESHOLD > 0
+	if (from->info.succ_index)
+		return find_indexed_edge(from, addr);
+#endif
+
 	CGD_ASSERT(from->info.successors != 0);
 	size = CGD_(smart_list_count)(from->info.successors);
 	for (i = 0; i < size; i++) {
 		CfgEdge* edge;
-		CfgInstrRef* ref;
+		Addr head;
 
 		edge = (CfgEdge*) CGD_(smart_list_at)(from->info.successors, i);
 		CGD_ASSERT(edge != 0);
 
 		switch (edge->dst->type) {
 			case CFG_BLOCK:
-				ref = edge->dst->data.block->instrs.leader;
-				CGD_ASSERT(ref != 0);
+				head = edge->dst->data.block->addr;
 				break;
 			case CFG_PHANTOM:
-				ref = edge->dst->data.phantom;
-				CGD_ASSERT(ref != 0);
+				head = edge->dst->data.phantom->addr;
 				break;
 			default:
-				ref = 0;
+				head = 0;
 				break;
 		}
 
 		// Check if the successors head instruction matches the next address.
-		if (ref != 0 && ref->instr->addr == addr)
+		if (head != 0 && head == addr)
 			return edge;
 	}
 
@@ -1363,20 +1641,20 @@ CfgEdge* get_succ_edge(CFG* cfg, CfgNode* from, Addr addr) {
 
 static
 void phantom2block(CFG* cfg, CfgNode* node, Int new_size) {
-	CfgInstrRef* ref;
+	UniqueInstr* instr;
 
 	CGD_ASSERT(node != 0 && node->type == CFG_PHANTOM);
 
-	ref = node->data.phantom;
+	instr = node->data.phantom;
 
-	if (ref->instr->size == 0)
-		ref->instr->size = new_size;
+	if (instr->size == 0)
+		instr->size = new_size;
 	else
-		CGD_ASSERT(ref->instr->size == new_size);
+		CGD_ASSERT(instr->size == new_size);
 
+	// Its reference in the CFG cache is kept: same node, the head of the block.
 	node->type = CFG_BLOCK;
-	node->data.block = new_block(ref);
-	ref->node = node;
+	node->data.block = new_block(&instr, 1);
 
 	// Add the successors list.
 	CGD_ASSERT(node->info.successors == 0);
@@ -1387,13 +1665,18 @@ void phantom2block(CFG* cfg, CfgNode* node, Int new_size) {
 	cfg->stats.phantoms--;
 }
 
+// With profiling, the edges passed are incremented by count
+// (0 if the transition is counted somewhere else).
+#if ENABLE_PROFILING
+CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_offset, ULong count) {
+#else
 CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_offset) {
+#endif
 	Addr base_addr, addr;
 	UInt bb_idx, size;
 	InstrGroupInfo group;
 	Int accumulated_size;
-	CfgInstrRef* curr;
-	CfgInstrRef* next;
+	Int curr;
 #if CFG_NODE_CACHE_SIZE > 0
 	CfgNodeBlockCache* cache;
 #endif
@@ -1408,7 +1691,7 @@ CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_o
 	group = bb->groups[group_offset];
 
 #if CFG_NODE_CACHE_SIZE > 0
-	cache = cfgblock_cache(working, group.group_addr);
+	cache = cfgblock_cache(cfg, working, group.group_addr, group.group_size);
 	cache->addr = group.group_addr;
 	cache->size = group.group_size;
 #if ENABLE_PROFILING
@@ -1420,23 +1703,24 @@ CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_o
 	bb_idx = group.bb_info.first_instr;
 	base_addr = bb_addr(bb);
 
-	// Current instruction reference in the working node,
+	// Position of the current instruction in the working node,
 	// can be any from head to tail. We use it to match the
 	// instructions in the group in sequence.
 	//
-	// A null value is used to indicate that the current
+	// A negative value is used to indicate that the current
 	// instruction in the group must be a successor of
 	// the working node. The first instruction of this
-	// group must always be a successor, hence the null value.
-	curr = 0;
+	// group must always be a successor, hence the negative value.
+	curr = -1;
 
 	accumulated_size = 0;
 	while (accumulated_size < group.group_size) {
 		// If null, find the successor of the working that
 		// matches the current instruction in the group.
 		// Create, split or transform the node if necessary.
-		if (!curr) {
+		if (curr < 0) {
 			CfgEdge* edge;
+			CfgInstrRef* ref;
 
 			CGD_ASSERT(bb_idx < bb->instr_count);
 			addr = base_addr + bb->instr[bb_idx].instr_offset;
@@ -1454,68 +1738,76 @@ CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_o
 
 				// Use it as the new working node.
 				CGD_ASSERT(edge->dst->type == CFG_BLOCK);
-				next = edge->dst->data.block->instrs.leader;
 #if ENABLE_PROFILING
-				edge->count++;
+				edge->count += count;
 #endif
 				working = edge->dst;
+
+				// Now, its head will be our current instruction.
+				curr = 0;
 			// If it is not a direct successor, check if there is a instruction
 			// with this address already exists in the CFG in some block.
 			// This block will be a successor of the working node.
-			} else if ((next = cfg_instr_find(cfg, addr))) {
+			} else if ((ref = cfg_instr_find(cfg, addr))) {
+				CfgNode* node = ref->node;
+
 				// If the next node is a phantom, convert to a block node.
-				if (next->node->type == CFG_PHANTOM)
-					phantom2block(cfg, next->node, size);
+				if (node->type == CFG_PHANTOM)
+					phantom2block(cfg, node, size);
 				// If the instruction is not the first in the block, split it.
-				else if (!ref_is_head(next))
-					cfgnode_split(cfg, next);
+				else if (!ref_is_head(ref))
+					cfgnode_split(cfg, node, ref_block_pos(ref));
 
 				// Connect the working block to this and make it the current
 				// working node.
-				CGD_ASSERT(ref_is_head(next));
+				CGD_ASSERT(node->data.block->addr == addr);
 #if ENABLE_PROFILING
-				add_edge2nodes(cfg, working, next->node, 1);
+				add_edge2nodes(cfg, working, node, count);
 #else
-				add_edge2nodes(cfg, working, next->node);
+				add_edge2nodes(cfg, working, node);
 #endif
-				working = next->node;
+				working = node;
+
+				// Now, its head will be our current instruction.
+				curr = 0;
 			// In this case, the instruction is new and we can:
 			// (1) append it to the working node (if possible); or
 			// (2) create a new block with it as the head instruction that
 			// will be connected to the working. This block will be the
 			// new working node.
 			} else {
-				next = new_instr_ref(CGD_(get_instr)(addr, size));
+				UniqueInstr* instr = CGD_(get_instr)(addr, size);
 				// Append the instruction if possible.
 				if (bb_idx > group.bb_info.first_instr && working->type == CFG_BLOCK &&
 					!cfgnode_has_successors(working) && !cfgnode_has_calls(working)) {
-					CGD_ASSERT((working->data.block->instrs.tail->instr->addr +
-							working->data.block->instrs.tail->instr->size) == addr);
-					add_ref2node(cfg, working, next);
+					add_instr2node(cfg, working, instr);
+
+					// Now, the appended one will be our current instruction.
+					curr = working->data.block->instrs.count - 1;
 				// Create a new block, connect the working to it and
 				// make it the new working node.
 				} else {
-					CfgNode* node = new_cfgnode_block(cfg, next);
+					CfgNode* node = new_cfgnode_block(cfg, &instr, 1);
 #if ENABLE_PROFILING
-					add_edge2nodes(cfg, working, node, 1);
+					add_edge2nodes(cfg, working, node, count);
 #else
 					add_edge2nodes(cfg, working, node);
 #endif
 					working = node;
+
+					// Now, its head will be our current instruction.
+					curr = 0;
 				}
 			}
-
-			// Now, this will be our current instruction.
-			curr = next;
 		}
 
 		// Try to process the whole block if possible.
-		if (ref_is_head(curr) &&
+		if (curr == 0 &&
 				((accumulated_size + working->data.block->size) <= group.group_size)) {
 			accumulated_size += working->data.block->size;
 			bb_idx += working->data.block->instrs.count;
 
-			curr = 0;
+			curr = -1;
 		// Otherwise, process instruction by instruction in the block.
 		} else {
 			do {
@@ -1523,31 +1815,36 @@ CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_o
 				addr = base_addr + bb->instr[bb_idx].instr_offset;
 				size = bb->instr[bb_idx].instr_size;
 
-				CGD_ASSERT(curr->instr->addr == addr);
-				CGD_ASSERT(curr->instr->size == size);
+				CGD_ASSERT(working->data.block->instrs.list[curr]->addr == addr);
+				CGD_ASSERT(working->data.block->instrs.list[curr]->size == size);
 
 				accumulated_size += size;
 				bb_idx++;
 
-				curr = curr->next;
-			} while (curr && accumulated_size < group.group_size);
+				curr++;
+			} while (curr < working->data.block->instrs.count &&
+						accumulated_size < group.group_size);
+
+			if (curr == working->data.block->instrs.count)
+				curr = -1;
 		}
 	}
 	CGD_ASSERT(accumulated_size == group.group_size);
 
 	// If there is a current instruction, this means we didn't reach
 	// the end of block, thus a split is required.
-	if (curr) {
-		working = cfgnode_split(cfg, curr);
+	if (curr >= 0) {
+		CfgNode* node = working;
+		working = cfgnode_split(cfg, node, curr);
 
 #if ENABLE_PROFILING
 		{
 			// Ugly hack because this whole block was already
 			// accounted for. So, decrease the edge count here
 			// since it will be added back in the next iteration.
-			CfgEdge* edge = find_edge(working, curr->node);
+			CfgEdge* edge = find_edge(working, node);
 			CGD_ASSERT(edge != 0);
-			edge->count--;
+			edge->count -= count;
 		}
 #endif
 	}
@@ -1559,22 +1856,93 @@ CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_o
 	return working;
 }
 
-void CGD_(cfgnode_set_phantom)(CFG* cfg, CfgNode* working, Addr to,
-			BBJumpKind jmpkind, Bool indirect) {
-	CfgInstrRef* next;
-#if CFG_NODE_CACHE_SIZE > 0
-	CfgNodePhantomCache* cache;
-#endif
+/*
+ * Find the node the working node moves to after the first group of
+ * a BB, if the group is already in the CFG: it must start a block and
+ * end another one, with the blocks in between linked in sequence.
+ * Nothing is changed, not even the edge counts.
+ */
+CfgNode* CGD_(cfg_find_block)(CFG* cfg, BB* bb) {
+	CfgInstrRef* ref;
+	CfgNode* node;
+	InstrGroupInfo* group;
+	Int size;
+
+	CGD_ASSERT(cfg != 0);
+	CGD_ASSERT(bb != 0);
+
+	group = &(bb->groups[0]);
+	ref = cfg_instr_find(cfg, group->group_addr);
+	if (!ref || ref->node->type != CFG_BLOCK || !ref_is_head(ref))
+		return 0;
+
+	node = ref->node;
+	size = node->data.block->size;
+	while (size < group->group_size) {
+		CfgEdge* edge = get_succ_edge(cfg, node, group->group_addr + size);
+		if (!edge || edge->dst->type != CFG_BLOCK)
+			return 0;
+
+		node = edge->dst;
+		size += node->data.block->size;
+	}
+
+	return size == group->group_size ? node : 0;
+}
+
+static
+void cfgnode_set_phantom(CFG* cfg, CfgNode* working, Addr to) {
+	CfgInstrRef* ref;
+	CfgNode* next;
 
 	CGD_ASSERT(cfg != 0);
 	CGD_ASSERT(working != 0);
 	CGD_ASSERT(working->type == CFG_BLOCK);
+	CGD_ASSERT(to != 0);
 
-#if CFG_NODE_CACHE_SIZE > 0
-	cache = cfgphantom_cache(working, to);
-	cache->addr = to;
-	cache->indirect = indirect;
+	// Ignore the phantom node if there is a call to this address.
+	if (find_call_with_addr(working, to))
+		return;
+
+	// If it does not exist, take some actions.
+	if (!get_succ_edge(cfg, working, to)) {
+		// If there is no next instruction, check if the address
+		// is already present in another part of the code.
+		if ((ref = cfg_instr_find(cfg, to))) {
+			next = ref->node;
+
+			// Check if we need to split it: only if it is
+			// a block node and the instruction is not the first.
+			if (next->type == CFG_BLOCK && !ref_is_head(ref))
+				// Split the block, the node keeps the instruction.
+				cfgnode_split(cfg, next, ref_block_pos(ref));
+		} else {
+			// If the instruction is new, we need to create
+			// a phantom node for it.
+			next = new_cfgnode_phantom(cfg, CGD_(get_instr)(to, 0));
+		}
+
+		// Connect the nodes.
+#if ENABLE_PROFILING
+		add_edge2nodes(cfg, working, next, 0);
+#else
+		add_edge2nodes(cfg, working, next);
 #endif
+	}
+}
+
+/*
+ * Record that the working node is left by an exit of a BB. The phantom
+ * node (and edge) for its target is only created by
+ * CGD_(cfg_materialize_phantoms), out of the execution path.
+ */
+void CGD_(cfgnode_record_exit)(CFG* cfg, CfgNode* working, Addr to,
+			BBJumpKind jmpkind, Bool indirect) {
+	CfgInstrRef* ref;
+
+	CGD_ASSERT(cfg != 0);
+	CGD_ASSERT(working != 0);
+	CGD_ASSERT(working->type == CFG_BLOCK);
 
 	switch (jmpkind) {
 		case bjk_None:
@@ -1602,33 +1970,56 @@ void CGD_(cfgnode_set_phantom)(CFG* cfg, CfgNode* working, Addr to,
 	CGD_ASSERT(to != 0);
 	CGD_ASSERT(indirect == False);
 
-	// Ignore the phantom node if there is a call to this address.
-	if (find_call_with_addr(working, to))
+	// Most of the time the exit target was already executed from this
+	// node, or it is a phantom of it (loaded from --cfg-infile), which is
+	// found by address without scanning the records.
+	ref = cfg_instr_find(cfg, to);
+	if (ref && (ref->node->type == CFG_PHANTOM ||
+			(ref->node->type == CFG_BLOCK && ref_is_head(ref))) &&
+			get_succ_edge(cfg, working, to))
 		return;
 
-	// If it does not exist, take some actions.
-	if (!get_succ_edge(cfg, working, to)) {
-		// If there is no next instruction, check if the address
-		// is already present in another part of the code.
-		if ((next = cfg_instr_find(cfg, to))) {
-			// Check if we need to split it: only if it is
-			// a block node and the instruction is not the first.
-			if (next->node->type == CFG_BLOCK && !ref_is_head(next))
-				// Split the block and get the new reference.
-				cfgnode_split(cfg, next);
-		} else {
-			// If the instruction is new, we need to create
-			// a phantom node for it.
-			next = new_instr_ref(CGD_(get_instr)(to, 0));
-			new_cfgnode_phantom(cfg, next);
-		}
+	if (!working->info.exits)
+		working->info.exits = CGD_(new_smart_list)(2);
+	else if (CGD_(smart_list_contains)(working->info.exits, (void*) to, 0))
+		return;
 
-		// Connect the nodes.
-#if ENABLE_PROFILING
-		add_edge2nodes(cfg, working, next->node, 0);
-#else
-		add_edge2nodes(cfg, working, next->node);
-#endif
+	CGD_(smart_list_add)(working->info.exits, (void*) to);
+	CGD_(stat).phantom_records++;
+
+	// Account for the phantom node it will become (see cfg_is_complete).
+	if (!ref && !find_call_with_addr(working, to)) {
+		cfg->stats.phantoms++;
+		cfg->stats.deferred++;
+	}
+}
+
+void CGD_(cfg_materialize_phantoms)(CFG* cfg) {
+	Int i, j, size, count;
+
+	CGD_ASSERT(cfg != 0);
+
+	// The phantoms are counted again as they are created.
+	cfg->stats.phantoms -= cfg->stats.deferred;
+	cfg->stats.deferred = 0;
+
+	// Splits and new phantoms only append nodes without recorded exits.
+	size = CGD_(smart_list_count)(cfg->nodes);
+	for (i = 0; i < size; i++) {
+		CfgNode* node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
+		CGD_ASSERT(node != 0);
+
+		if (!node->info.exits)
+			continue;
+
+		count = CGD_(smart_list_count)(node->info.exits);
+		for (j = 0; j < count; j++)
+			cfgnode_set_phantom(cfg, node,
+				(Addr) CGD_(smart_list_at)(node->info.exits, j));
+
+		CGD_(smart_list_clear)(node->info.exits, 0);
+		CGD_(delete_smart_list)(node->info.exits);
+		node->info.exits = 0;
 	}
 }
 
@@ -1643,7 +2034,7 @@ void CGD_(cfgnode_set_call)(CFG* cfg, CfgNode* working, CFG* called, Bool indire
 	CGD_ASSERT(called != 0);
 
 #if CFG_NODE_CACHE_SIZE > 0
-	cache = cfgcall_cache(working, called->addr);
+	cache = cfgcall_cache(cfg, working, called, indirect);
 	cache->called = called;
 	cache->indirect = indirect;
 #if ENABLE_PROFILING
@@ -1681,10 +2072,21 @@ CfgNode* CGD_(cfgnode_set_exit)(CFG* cfg, CfgNode* working) {
 	CGD_ASSERT(working->type == CFG_BLOCK);
 
 #if CFG_NODE_CACHE_SIZE > 0
+#if ENABLE_PROFILING
+	if (working->cache.exit.enabled && working->cache.exit.count > 0) {
+		CfgEdge* edge = find_edge(working, cfg->exit);
+		CGD_ASSERT(edge != 0);
+
+		edge->count += working->cache.exit.count;
+		CGD_HOT_STAT(CGD_(stat).exit_cache.flushes);
+	}
+#endif // ENABLE_PROFILING
+
 	working->cache.exit.enabled = True;
 #if ENABLE_PROFILING
 	working->cache.exit.count = 0;
 #endif // ENABLE_PROFILING
+	CGD_HOT_STAT(cfg->stats.cache_misses);
 #endif // CFG_NODE_CACHE_SIZE
 
 	// Add the node if it is does not exist yet.
@@ -1729,7 +2131,7 @@ static
 void cfgnode_merge(CFG* cfg, CfgEdge* edge) {
 	Int i, size;
 	CfgBlock* block;
-	CfgInstrRef* ref;
+	CfgBlock* merged;
 
 	CGD_ASSERT(cfg != 0);
 	CGD_ASSERT(edge != 0);
@@ -1738,22 +2140,29 @@ void cfgnode_merge(CFG* cfg, CfgEdge* edge) {
 	block = edge->src->data.block;
 	CGD_ASSERT(block != 0);
 
-	ref = edge->dst->data.block->instrs.leader;
-	CGD_ASSERT((block->instrs.tail->instr->addr +
-		block->instrs.tail->instr->size) == ref->instr->addr);
-	block->instrs.tail->next = ref;
+	merged = edge->dst->data.block;
+	CGD_ASSERT((block->addr + block->size) == merged->addr);
+
+	// Make room for the instructions of the merged block.
+	if ((block->instrs.count + merged->instrs.count) > block->instrs.capacity) {
+		block->instrs.capacity = block->instrs.count + merged->instrs.count;
+		block->instrs.list = (UniqueInstr**) CGD_REALLOC("cgd.cfg.cm.1",
+					block->instrs.list, (block->instrs.capacity * sizeof(UniqueInstr*)));
+	}
+
+	// Move the instructions, fix their references and update block count.
+	for (i = 0; i < merged->instrs.count; i++) {
+		UniqueInstr* instr = merged->instrs.list[i];
 
-	// Fix the reference nodes and update block count.
-	while (ref) {
-		block->size += ref->instr->size;
-		ref->node = edge->src;
-		ref = ref->next;
+		instr_refs_put(cfg->cache.refs, instr->addr, edge->src,
+				(block->instrs.base + block->instrs.count));
+		block->instrs.list[block->instrs.count++] = instr;
+		block->size += instr->size;
 	}
 
-	// Update the block instructions.
-	block->instrs.tail = edge->dst->data.block->instrs.tail;
-	block->instrs.count += edge->dst->data.block->instrs.count;
-	VG_(memset)(&(edge->dst->data.block->instrs), 0, sizeof(block->instrs));
+	// Release the instructions of the merged block.
+	CGD_DATA_FREE(merged->instrs.list, (merged->instrs.capacity * sizeof(UniqueInstr*)));
+	VG_(memset)(&(merged->instrs), 0, sizeof(merged->instrs));
 
 	// Move the calls.
 	if (block->calls) {
@@ -1763,6 +2172,11 @@ void cfgnode_merge(CFG* cfg, CfgEdge* edge) {
 	}
 	block->calls = edge->dst->data.block->calls;
 	edge->dst->data.block->calls = 0;
+#if CALLS_INDEX_THRESHOLD > 0
+	CGD_ASSERT(block->calls_index == 0);
+	block->calls_index = edge->dst->data.block->calls_index;
+	edge->dst->data.block->calls_index = 0;
+#endif
 
 	// Move the indirect flag.
 	CGD_ASSERT(block->indirect == False);
@@ -1782,38 +2196,18 @@ void cfgnode_merge(CFG* cfg, CfgEdge* edge) {
 
 		tmp->src = edge->src;
 		CGD_(smart_list_set)(edge->dst->info.successors, i, 0);
-		CGD_(smart_list_add)(edge->src->info.successors, tmp);
+		edge_list_add(edge->src->info.successors, tmp, EDGE_SUCC_LIST);
 	}
+#if SUCC_INDEX_THRESHOLD > 0
+	rebuild_succ_index(edge->src);
+#endif
 
 	// Remove edge.
 	CGD_ASSERT(CGD_(smart_list_count)(edge->dst->info.predecessors) == 1);
 	CGD_(smart_list_clear)(edge->dst->info.predecessors, 0);
-	size = CGD_(smart_list_count)(cfg->edges);
-	for (i = 0; i < size; i++) {
-		CfgEdge* tmp = (CfgEdge*) CGD_(smart_list_at)(cfg->edges, i);
-		CGD_ASSERT(tmp != 0);
-
-		if (tmp == edge) {
-			CGD_(smart_list_set)(cfg->edges, i, CGD_(smart_list_tail)(cfg->edges));
-			CGD_(smart_list_set)(cfg->edges, (size - 1), 0);
-			break;
-		}
-	}
-	CGD_ASSERT(i < size);
 
 	// Remove node.
-	size = CGD_(smart_list_count)(cfg->nodes);
-	for (i = 0; i < size; i++) {
-		CfgNode* tmp = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
-		CGD_ASSERT(tmp != 0);
-
-		if (tmp == edge->dst) {
-			CGD_(smart_list_set)(cfg->nodes, i, CGD_(smart_list_tail)(cfg->nodes));
-			CGD_(smart_list_set)(cfg->nodes, (size - 1), 0);
-			break;
-		}
-	}
-	CGD_ASSERT(i < size);
+	cfg_remove_node(cfg, edge->dst);
 
 	// Free the resources.
 	cfg->stats.blocks--;
@@ -1824,6 +2218,10 @@ void cfgnode_merge(CFG* cfg, CfgEdge* edge) {
 void CGD_(fix_cfg)(CFG* cfg) {
 	Int i, size;
 
+	// Only the CFGs changed since loaded need fixing.
+	if (!cfg->dirty)
+		return;
+
 	i = 0;
 	size = CGD_(smart_list_count)(cfg->nodes);
 	while (i < size) {
@@ -1854,14 +2252,29 @@ void CGD_(check_cfg)(CFG* cfg) {
 	Int indirects;
 #if ENABLE_PROFILING
 	ULong leaving;
+	Bool conserved;
 #endif
 
 	CGD_ASSERT(cfg != 0);
+
+	// Skip the validation as requested by --check-cfg.
+	if (CGD_(clo).check_cfg == CHECK_CFG_NONE ||
+		(CGD_(clo).check_cfg == CHECK_CFG_DIRTY && !cfg->dirty)) {
+		cfg->dirty = False;
+		return;
+	}
+
 	CGD_ASSERT(cfg->exit != 0 || cfg->halt != 0);
 
 	indirects = 0;
 #if ENABLE_PROFILING
 	leaving = 0;
+
+	// The counts of a sampled run (--sample) do not conserve the flow:
+	// the state is resynchronized in a burst without the edge into its
+	// node, the last BBs of a burst are not counted and each count is
+	// scaled on its own. Only their structure can be checked.
+	conserved = CGD_(clo).sample.off == 0;
 #endif
 
 	size = CGD_(smart_list_count)(cfg->nodes);
@@ -1877,6 +2290,7 @@ void CGD_(check_cfg)(CFG* cfg) {
 
 		node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
 		CGD_ASSERT(node != 0);
+		CGD_ASSERT(node->idx == i);
 
 		in.size = node->info.predecessors ?
 						CGD_(smart_list_count)(node->info.predecessors) : 0;
@@ -1905,14 +2319,12 @@ void CGD_(check_cfg)(CFG* cfg) {
 		switch (node->type) {
 			case CFG_ENTRY:
 				{
-					CfgInstrRef* ref;
-
 					// An entry node has no predecessors and only a single successor.
 					CGD_ASSERT(in.size == 0);
 					CGD_ASSERT(out.size == 1);
 #if ENABLE_PROFILING
 					CGD_ASSERT(in.count == 0);
-					CGD_ASSERT(out.count == cfg->stats.execs);
+					CGD_ASSERT(!conserved || out.count == cfg->stats.execs);
 #endif
 
 					edge = (CfgEdge*) CGD_(smart_list_at)(node->info.successors, 0);
@@ -1923,9 +2335,7 @@ void CGD_(check_cfg)(CFG* cfg) {
 					CGD_ASSERT(edge->dst->data.block->instrs.count > 0);
 
 					// The first instruction address must match the cfg address.
-					ref = edge->dst->data.block->instrs.leader;
-					CGD_ASSERT(ref != 0);
-					CGD_ASSERT(cfg->addr == ref->instr->addr);
+					CGD_ASSERT(cfg->addr == edge->dst->data.block->instrs.list[0]->addr);
 				}
 
 				break;
@@ -1943,8 +2353,7 @@ void CGD_(check_cfg)(CFG* cfg) {
 				break;
 			case CFG_BLOCK:
 				{
-					Int total, count;
-					CfgInstrRef* ref;
+					Int total;
 					CfgBlock* block;
 
 					// A block node must have at least one predecessor and one successor.
@@ -1953,32 +2362,32 @@ void CGD_(check_cfg)(CFG* cfg) {
 
 #if ENABLE_PROFILING
 					// The in and out degree of edges must match.
-					CGD_ASSERT(in.count == out.count);
+					CGD_ASSERT(!conserved || in.count == out.count);
 #endif
 
 					block = node->data.block;
 					CGD_ASSERT(block != 0);
 
-					count = 0;
+					CGD_ASSERT(block->instrs.count > 0);
+					CGD_ASSERT(block->instrs.list[0]->addr == block->addr);
+
 					total = 0;
-					ref = block->instrs.leader;
-					while (ref) {
-						if (ref->next) {
-							CGD_ASSERT((ref->instr->addr + ref->instr->size) == ref->next->instr->addr);
-						} else {
-							CGD_ASSERT(block->instrs.tail == ref);
+					for (j = 0; j < block->instrs.count; j++) {
+						UniqueInstr* instr = block->instrs.list[j];
+						CfgInstrRef* ref = cfg_instr_find(cfg, instr->addr);
+
+						if ((j + 1) < block->instrs.count) {
+							CGD_ASSERT((instr->addr + instr->size) == block->instrs.list[j + 1]->addr);
 						}
 
-						count++;
-						total += ref->instr->size;
+						// The instruction reference must point to this position.
+						CGD_ASSERT(ref != 0 && ref->node == node);
+						CGD_ASSERT(ref_block_pos(ref) == j);
 
-						ref = ref->next;
+						total += instr->size;
 					}
-					CGD_ASSERT(count == block->instrs.count);
 					CGD_ASSERT(total == block->size);
 
-					ref = block->instrs.tail;
-
 					if (block->calls) {
 						size2 = CGD_(smart_list_count)(block->calls);
 						for (j = 0; j < size2; j++) {
@@ -2021,7 +2430,7 @@ void CGD_(check_cfg)(CFG* cfg) {
 			(1 + (cfg->exit ? 1 : 0) + (cfg->halt ? 1 : 0) + cfg->stats.blocks + cfg->stats.phantoms));
 	CGD_ASSERT(indirects == cfg->stats.indirects);
 #if ENABLE_PROFILING
-	CGD_ASSERT(leaving == cfg->stats.execs);
+	CGD_ASSERT(!conserved || leaving == cfg->stats.execs);
 #endif
 
 	// After checking, set the CFG as not dirty.
@@ -2085,25 +2494,23 @@ void fprint_cfg(VgFile* out, CFG* cfg, Bool detailed) {
 					node->data.block->addr, node->data.block->size);
 
 			if (detailed) {
-				CfgInstrRef* ref;
+				Int k;
 
 				VG_(fprintf)(out, "     | [instrs]\\l\n");
 
-				ref = node->data.block->instrs.leader;
-				CGD_ASSERT(ref != 0);
+				CGD_ASSERT(node->data.block->instrs.count > 0);
+				for (k = 0; k < node->data.block->instrs.count; k++) {
+					UniqueInstr* instr = node->data.block->instrs.list[k];
 
-				while (ref) {
 					VG_(fprintf)(out, "     &nbsp;&nbsp;0x%lx \\<+%d\\>: ",
-							ref->instr->addr, ref->instr->size);
+							instr->addr, instr->size);
 
-					if (ref->instr->name)
-						fprintf_escape(out, ref->instr->name);
+					if (instr->name)
+						fprintf_escape(out, instr->name);
 					else
 						VG_(fprintf)(out, "???");
 
 					VG_(fprintf)(out, "\\l\n");
-
-					ref = ref->next;
 				}
 			}
 
@@ -2164,7 +2571,7 @@ void fprint_cfg(VgFile* out, CFG* cfg, Bool detailed) {
 		} else if (node->type == CFG_PHANTOM) {
 			VG_(fprintf)(out, "  \"0x%lx\" [label=\"{\n", CGD_(cfgnode_addr)(node));
 			VG_(fprintf)(out, "     0x%lx\\l\n",
-					node->data.phantom->instr->addr);
+					node->data.phantom->addr);
 			VG_(fprintf)(out, "  }\", style=dashed]\n");
 		} else {
 			tl_assert(0);
@@ -2178,26 +2585,35 @@ void fprint_cfg(VgFile* out, CFG* cfg, Bool detailed) {
 		}
 	}
 
-	size = CGD_(smart_list_count)(cfg->edges);
+	size = CGD_(smart_list_count)(cfg->nodes);
 	for (i = 0; i < size; i++) {
-		CfgEdge* edge = (CfgEdge*) CGD_(smart_list_at)(cfg->edges, i);
-		CGD_ASSERT(edge != 0);
+		CfgNode* node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
+		CGD_ASSERT(node != 0);
 
-		if (edge->src->type == CFG_ENTRY)
-			VG_(fprintf)(out, "  %s -> ", CGD_(cfgnode_type2str)(edge->src->type, False));
-		else
-			VG_(fprintf)(out, "  \"0x%lx\" -> ", CGD_(cfgnode_addr)(edge->src));
+		if (!node->info.successors)
+			continue;
 
-		if (edge->dst->type == CFG_EXIT || edge->dst->type == CFG_HALT)
-			VG_(fprintf)(out, "%s", CGD_(cfgnode_type2str)(edge->dst->type, False));
-		else
-			VG_(fprintf)(out, "\"0x%lx\"", CGD_(cfgnode_addr)(edge->dst));
+		size2 = CGD_(smart_list_count)(node->info.successors);
+		for (j = 0; j < size2; j++) {
+			CfgEdge* edge = (CfgEdge*) CGD_(smart_list_at)(node->info.successors, j);
+			CGD_ASSERT(edge != 0);
+
+			if (edge->src->type == CFG_ENTRY)
+				VG_(fprintf)(out, "  %s -> ", CGD_(cfgnode_type2str)(edge->src->type, False));
+			else
+				VG_(fprintf)(out, "  \"0x%lx\" -> ", CGD_(cfgnode_addr)(edge->src));
+
+			if (edge->dst->type == CFG_EXIT || edge->dst->type == CFG_HALT)
+				VG_(fprintf)(out, "%s", CGD_(cfgnode_type2str)(edge->dst->type, False));
+			else
+				VG_(fprintf)(out, "\"0x%lx\"", CGD_(cfgnode_addr)(edge->dst));
 
 #if ENABLE_PROFILING
-		VG_(fprintf)(out, " [label=\" %llu\"]", edge->count);
+			VG_(fprintf)(out, " [label=\" %llu\"]", edge->count);
 #endif
 
-		VG_(fprintf)(out, "\n");
+			VG_(fprintf)(out, "\n");
+		}
 	}
 
 	VG_(fprintf)(out, "}\n");
@@ -2238,7 +2654,6 @@ void write_cfg(CFG* cfg) {
 	size = CGD_(smart_list_count)(cfg->nodes);
 	for (i = 0; i < size; i++) {
 		CfgNode* node;
-		CfgInstrRef* ref;
 
 		node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
 		CGD_ASSERT(node != 0);
@@ -2250,17 +2665,14 @@ void write_cfg(CFG* cfg) {
 		VG_(fprintf)(fp, "[node 0x%lx 0x%lx %d ", cfg->addr,
 			node->data.block->addr, node->data.block->size);
 
-		ref = node->data.block->instrs.leader;
-		CGD_ASSERT(ref != 0);
+		CGD_ASSERT(node->data.block->instrs.count > 0);
 
 		VG_(fprintf)(fp, "[");
-		while (ref) {
-			VG_(fprintf)(fp, "%d", ref->instr->size);
-
-			if (ref->next)
+		for (j = 0; j < node->data.block->instrs.count; j++) {
+			if (j > 0)
 				VG_(fprintf)(fp, " ");
 
-			ref = ref->next;
+			VG_(fprintf)(fp, "%d", node->data.block->instrs.list[j]->size);
 		}
 		VG_(fprintf)(fp, "] ");
 
@@ -2351,6 +2763,11 @@ void CGD_(write_cfgs)(const HChar* filename) {
 	}
 	CGD_ASSERT(fp != 0);
 
+#if ENABLE_PROFILING
+	if (CGD_(clo).sample.off > 0)
+		VG_(fprintf)(fp, "# estimated counts: sampled %llu of every %llu BBs\n",
+			CGD_(clo).sample.on, CGD_(clo).sample.on + CGD_(clo).sample.off);
+#endif
 	VG_(fprintf)(fp, "# [cfg cfg-addr{:invocations} cfg-name is-complete]\n");
 	VG_(fprintf)(fp, "# [node cfg-addr node-addr node-size [list of instr-size] [list of cfg-addr{:count}]\n");
 	VG_(fprintf)(fp, "#       [list of signal-id->cfg-addr{:count}] is-indirect [list of succ-node{:count}]\n");
@@ -2361,6 +2778,75 @@ void CGD_(write_cfgs)(const HChar* filename) {
 	fp = 0;
 }
 
+static
+void write_cfg_indirect_calls(CFG* cfg) {
+	Int i, size;
+	Int j, size2;
+
+	CGD_ASSERT(cfg != 0);
+	CGD_ASSERT(fp != 0);
+
+	size = CGD_(smart_list_count)(cfg->nodes);
+	for (i = 0; i < size; i++) {
+		CfgNode* node;
+
+		node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
+		CGD_ASSERT(node != 0);
+
+		// Only blocks ending in an indirect call are call sites.
+		if (node->type != CFG_BLOCK || !node->data.block->indirect ||
+			!node->data.block->calls)
+			continue;
+
+		size2 = CGD_(smart_list_count)(node->data.block->calls);
+		if (size2 == 0)
+			continue;
+
+		if (!cfg->fdesc)
+			CGD_(cfg_build_fdesc)(cfg);
+
+		VG_(fprintf)(fp, "[site 0x%lx 0x%lx %d [", cfg->addr,
+			node->data.block->instrs.list[node->data.block->instrs.count - 1]->addr, size2);
+		for (j = 0; j < size2; j++) {
+			CfgCall* cfgCall = (CfgCall*) CGD_(smart_list_at)(node->data.block->calls, j);
+			CGD_ASSERT(cfgCall != 0);
+
+			if (j > 0)
+				VG_(fprintf)(fp, " ");
+
+			VG_(fprintf)(fp, "0x%lx", cfgCall->called->addr);
+#if ENABLE_PROFILING
+			if (cfgCall->count > 0)
+				VG_(fprintf)(fp, ":%llu", cfgCall->count);
+#endif
+		}
+		VG_(fprintf)(fp, "] \"");
+
+		if (cfg->fdesc)
+			CGD_(fprint_fdesc)(fp, cfg->fdesc);
+		else
+			VG_(fprintf)(fp, "unknown");
+		VG_(fprintf)(fp, "\"]\n");
+	}
+}
+
+void CGD_(write_indirect_calls)(const HChar* filename) {
+	CGD_ASSERT(fp == 0);
+	fp = VG_(fopen)(filename, VKI_O_WRONLY|VKI_O_TRUNC, 0);
+	if (fp == NULL) {
+		fp = VG_(fopen)(filename, VKI_O_CREAT|VKI_O_WRONLY,
+				VKI_S_IRUSR|VKI_S_IWUSR);
+	}
+	CGD_ASSERT(fp != 0);
+
+	VG_(fprintf)(fp, "# [site cfg-addr call-instr-addr callees [list of cfg-addr{:count}] cfg-name]\n");
+
+	CGD_(forall_cfg)(write_cfg_indirect_calls);
+
+	VG_(fclose)(fp);
+	fp = 0;
+}
+
 static
 Bool next_token(Int fd) {
     Int idx, state;
@@ -2619,8 +3105,8 @@ void CGD_(read_cfgs)(Int fd) {
 					phantom2block(cfg, node, instr_size);
 				// Otherwise, we will create the block node.
 				} else {
-					ref = new_instr_ref(CGD_(get_instr)(addr, instr_size));
-					node = new_cfgnode_block(cfg, ref);
+					UniqueInstr* instr = CGD_(get_instr)(addr, instr_size);
+					node = new_cfgnode_block(cfg, &instr, 1);
 				}
 				CGD_ASSERT(node->type == CFG_BLOCK);
 
@@ -2644,8 +3130,7 @@ void CGD_(read_cfgs)(Int fd) {
 
 					instr_size = token.data.number;
 
-					add_ref2node(cfg, node,
-							new_instr_ref(CGD_(get_instr)(addr, instr_size)));
+					add_instr2node(cfg, node, CGD_(get_instr)(addr, instr_size));
 
 					addr += instr_size;
 
@@ -2777,12 +3262,8 @@ void CGD_(read_cfgs)(Int fd) {
 							break;
 						case TKN_ADDR:
 							ref = cfg_instr_find(cfg, token.data.addr);
-							if (!ref) {
-								ref = new_instr_ref(CGD_(get_instr)(token.data.addr, 0));
-								new_cfgnode_phantom(cfg, ref);
-							}
-
-							dst = ref->node;
+							dst = ref ? ref->node :
+								new_cfgnode_phantom(cfg, CGD_(get_instr)(token.data.addr, 0));
 
 							has = next_token(fd);
 							CGD_ASSERT(has);
@@ -2823,8 +3304,12 @@ void CGD_(read_cfgs)(Int fd) {
 		CGD_ASSERT(has && token.type == TKN_BRACKET_CLOSE);
 	}
 
-	// Check the CFG's
-	CGD_(forall_cfg)(CGD_(check_cfg));
+	// The loaded CFGs are not changed yet, so they are only checked
+	// on --check-cfg=all; the others are checked once changed.
+	if (CGD_(clo).check_cfg == CHECK_CFG_ALL)
+		CGD_(forall_cfg)(CGD_(check_cfg));
+	else
+		CGD_(forall_cfg)(clear_dirty);
 }
 
 static
@@ -2881,15 +3366,12 @@ void CGD_(dump_cfg)(CFG* cfg) {
 
 void CGD_(forall_cfg)(void (*func)(CFG*)) {
 	UInt i;
-	CFG *cfg, *tmp;
+	CFG* cfg;
 
+	cfg_hash_finish(&cfgs);
 	for (i = 0; i < cfgs.size; i++) {
-		cfg = cfgs.table[i];
-		while (cfg) {
-			tmp = cfg->chain;
+		if ((cfg = cfg_hash_at(&cfgs, i)))
 			(*func)(cfg);
-			cfg = tmp;
-		}
 	}
 }
 
@@ -2917,12 +3399,14 @@ void CGD_(cfgnode_flush_edge_count)(CFG* cfg, CfgNode* working, CfgNodeBlockCach
 		size += CGD_(cfgnode_size)(edge->dst);
 
 		working = edge->dst;
+		CGD_HOT_STAT(CGD_(stat).edge_count_walks);
 	}
+	CGD_HOT_STAT(CGD_(stat).edge_count_flushes);
 	CGD_ASSERT(size == cache->size);
 	CGD_ASSERT(CGD_(cfgnodes_cmp)(working, cache->working));
 
 	// Mark the CFG as dirty.
-	cfg->dirty = True;
+	set_dirty(cfg);
 }
 
 void CGD_(cfgnode_flush_call_count)(CFG* cfg, CfgNode* working, CfgNodeCallCache* cache) {
@@ -2938,7 +3422,7 @@ void CGD_(cfgnode_flush_call_count)(CFG* cfg, CfgNode* working, CfgNodeCallCache
 	cfgCall->count += cache->count;
 
 	// Mark the CFG as dirty.
-	cfg->dirty = True;
+	set_dirty(cfg);
 }
 
 void CGD_(cfg_flush_all_counts)(CFG* cfg) {
@@ -2952,18 +3436,22 @@ void CGD_(cfg_flush_all_counts)(CFG* cfg) {
 		CGD_ASSERT(node != 0);
 
 		if (node->cache.block) {
-			for (j = 0; j < CFG_NODE_CACHE_SIZE; j++) {
+			for (j = 0; j < CGD_(clo).node_cache.size; j++) {
 				CfgNodeBlockCache* blockCache = &(node->cache.block[j]);
-				if (blockCache->count > 0)
+				if (blockCache->count > 0) {
 					CGD_(cfgnode_flush_edge_count)(cfg, node, blockCache);
+					CGD_HOT_STAT(CGD_(stat).block_cache.flushes);
+				}
 			}
 		}
 
 		if (node->cache.call) {
-			for (j = 0; j < CFG_NODE_CACHE_SIZE; j++) {
+			for (j = 0; j < CGD_(clo).node_cache.size; j++) {
 				CfgNodeCallCache* callCache = &(node->cache.call[j]);
-				if (callCache->count > 0)
+				if (callCache->count > 0) {
 					CGD_(cfgnode_flush_call_count)(cfg, node, callCache);
+					CGD_HOT_STAT(CGD_(stat).call_cache.flushes);
+				}
 			}
 		}
 
@@ -2972,6 +3460,63 @@ void CGD_(cfg_flush_all_counts)(CFG* cfg) {
 			CGD_ASSERT(edge != 0);
 
 			edge->count += node->cache.exit.count;
+			CGD_HOT_STAT(CGD_(stat).exit_cache.flushes);
+		}
+	}
+}
+#endif
+
+#if ENABLE_PROFILING
+/* Estimate the count of all executions from the sampled ones (--sample).
+ * Each count is rounded down on its own, so the sums of the estimates
+ * may differ a little from the estimates of the sums. */
+static __inline__
+ULong scale_count(ULong count) {
+	ULong on = CGD_(clo).sample.on;
+	ULong period = on + CGD_(clo).sample.off;
+
+	// Avoid the overflow of count * period.
+	return (count / on) * period + ((count % on) * period) / on;
+}
+
+void CGD_(cfg_scale_counts)(CFG* cfg) {
+	Int i, j, size;
+
+	CGD_ASSERT(cfg != 0);
+
+	cfg->stats.execs = scale_count(cfg->stats.execs);
+
+	size = CGD_(smart_list_count)(cfg->nodes);
+	for (i = 0; i < size; i++) {
+		CfgNode* node;
+
+		node = (CfgNode*) CGD_(smart_list_at)(cfg->nodes, i);
+		CGD_ASSERT(node != 0);
+
+		// Every edge is held by the successors of its source.
+		if (node->info.successors) {
+			for (j = 0; j < CGD_(smart_list_count)(node->info.successors); j++) {
+				CfgEdge* edge = (CfgEdge*) CGD_(smart_list_at)(node->info.successors, j);
+				edge->count = scale_count(edge->count);
+			}
+		}
+
+		if (node->type != CFG_BLOCK)
+			continue;
+
+		if (node->data.block->calls) {
+			for (j = 0; j < CGD_(smart_list_count)(node->data.block->calls); j++) {
+				CfgCall* cfgCall = (CfgCall*) CGD_(smart_list_at)(node->data.block->calls, j);
+				cfgCall->count = scale_count(cfgCall->count);
+			}
+		}
+
+		if (node->data.block->sighandlers) {
+			for (j = 0; j < CGD_(smart_list_count)(node->data.block->sighandlers); j++) {
+				CfgSignalHandler* cfgSighandler = (CfgSignalHandler*)
+						CGD_(smart_list_at)(node->data.block->sighandlers, j);
+				cfgSighandler->handler->count = scale_count(cfgSighandler->handler->count);
+			}
 		}
 	}
 }
@@ -61,8 +61,32 @@ Bool CGD_(process_cmd_line_option)(const HChar* arg)
    else if VG_BOOL_CLO(arg, "--ignore-failed-cfg", CGD_(clo).ignore_failed) {}
 #if ENABLE_PROFILING
    else if VG_BOOL_CLO(arg, "--ignore-profiling", CGD_(clo).ignore_profiling) {}
+   else if VG_STR_CLO(arg, "--sample", tmp_str) {
+	   HChar* end;
+
+	   CGD_(clo).sample.on = VG_(strtoull10)(tmp_str, &end);
+	   if (*end != ':' || CGD_(clo).sample.on == 0)
+		   VG_(fmsg_bad_option)(arg, "expected <on>:<off>, with <on> > 0\n");
+
+	   CGD_(clo).sample.off = VG_(strtoull10)(end + 1, &end);
+	   if (*end != 0)
+		   VG_(fmsg_bad_option)(arg, "expected <on>:<off>, with <on> > 0\n");
+   }
+#else
+   else if VG_BOOL_CLO(arg, "--freeze-complete", CGD_(clo).freeze.complete) {}
+   else if VG_BINT_CLO(arg, "--freeze-after", CGD_(clo).freeze.after, 1, 1000000000) {}
 #endif
    else if VG_BOOL_CLO(arg, "--emulate-calls", CGD_(clo).emulate_calls) {}
+   else if VG_STR_CLO(arg, "--check-cfg", tmp_str) {
+	   if (VG_(strcasecmp)(tmp_str, "all") == 0)
+		   CGD_(clo).check_cfg = CHECK_CFG_ALL;
+	   else if (VG_(strcasecmp)(tmp_str, "dirty") == 0)
+		   CGD_(clo).check_cfg = CHECK_CFG_DIRTY;
+	   else if (VG_(strcasecmp)(tmp_str, "none") == 0)
+		   CGD_(clo).check_cfg = CHECK_CFG_NONE;
+	   else
+		   VG_(fmsg_bad_option)(arg, "expected all, dirty or none\n");
+   }
    else if VG_STR_CLO(arg, "--cfg-dump", tmp_str) {
 	   if (VG_(strcasecmp)(tmp_str, "all") == 0) {
 		   CGD_ASSERT(CGD_(clo).dump_cfgs.all == False);
@@ -99,6 +123,11 @@ Bool CGD_(process_cmd_line_option)(const HChar* arg)
    else if VG_STR_CLO(arg, "--cfg-dump-dir", CGD_(clo).dump_cfgs.dir) {}
    else if VG_STR_CLO(arg, "--instrs-map", CGD_(clo).instrs_map) {}
    else if VG_STR_CLO(arg, "--mem-mappings", CGD_(clo).mem_mappings) {}
+   else if VG_STR_CLO(arg, "--indirect-calls", CGD_(clo).indirect_calls) {}
+#if CFG_NODE_CACHE_SIZE > 0
+   else if VG_BINT_CLO(arg, "--node-cache-size", CGD_(clo).node_cache.size, 1, 4096) {}
+   else if VG_BINT_CLO(arg, "--node-cache-ways", CGD_(clo).node_cache.ways, 1, 4096) {}
+#endif
 
    else
 	   return False;
@@ -116,14 +145,27 @@ void CGD_(print_usage)(void)
 "    --ignore-failed-cfg=no|yes   Ignore failed cfg input file read [no]\n"
 #if ENABLE_PROFILING
 "    --ignore-profiling=no|yes    Ignore profiling information from input file [no]\n"
+"    --sample=<on>:<off>          Profile bursts of <on> BBs every <off> BBs skipped,\n"
+"                                 with estimated counts (0 BBs skipped: exact) [1:0]\n"
+#else
+"    --freeze-complete=no|yes     Stop instrumenting the CFGs that are complete and\n"
+"                                 stable, except for calls and returns [no]\n"
+"    --freeze-after=<n>           Executions without new structure to freeze a CFG [100]\n"
 #endif
 "    --emulate-calls=no|yes       Emulate call for jumps in function entries [yes]\n"
+"    --check-cfg=all|dirty|none   Validate all CFGs, only the changed ones or none [dirty]\n"
 "    --cfg-dump=<name>            Dump DOT cfg file as cfg-<name>.dot [none]\n"
 "		  where <name> is a function name, an address (e.g. 0xNNNNNNNN), all or none\n"
 "         (can be used multiple times)\n"
 "    --cfg-dump-dir=<directory>   Directory where to dump the DOT cfgs [.]\n"
 "    --instrs-map=<f>             Instructions map (address:size:assembly per entry) file\n"
 "    --mem-mappings=<f>           Output file with memory mappings (bin, libs, ...)\n"
+"    --indirect-calls=<f>         Output file with the callees of each indirect call site\n"
+#if CFG_NODE_CACHE_SIZE > 0
+"    --node-cache-size=<n>        Entries of each CFG node cache (power of 2) [%d]\n"
+"    --node-cache-ways=<k>        Associativity of the CFG node caches (power of 2) [%d]\n"
+    , CFG_NODE_CACHE_SIZE, CFG_NODE_CACHE_WAYS
+#endif
     );
 }
 
@@ -152,14 +194,26 @@ void CGD_(set_clo_defaults)(void)
   CGD_(clo).ignore_failed    = False;
 #if ENABLE_PROFILING
   CGD_(clo).ignore_profiling = False;
+  CGD_(clo).sample.on        = 1;
+  CGD_(clo).sample.off       = 0;
+#else
+  CGD_(clo).freeze.complete  = False;
+  CGD_(clo).freeze.after     = 100;
 #endif
   CGD_(clo).emulate_calls    = True;
+  CGD_(clo).check_cfg        = CHECK_CFG_DIRTY;
   CGD_(clo).dump_cfgs.all    = False;
   CGD_(clo).dump_cfgs.addrs  = 0;
   CGD_(clo).dump_cfgs.fnames = 0;
   CGD_(clo).dump_cfgs.dir    = ".";
   CGD_(clo).instrs_map       = 0;
   CGD_(clo).mem_mappings     = 0;
+  CGD_(clo).indirect_calls   = 0;
+#if CFG_NODE_CACHE_SIZE > 0
+  CGD_(clo).node_cache.size  = CFG_NODE_CACHE_SIZE;
+  CGD_(clo).node_cache.ways  = CFG_NODE_CACHE_WAYS;
+  CGD_(clo).node_cache.sets_mask = 0;
+#endif
 
 #if CGD_ENABLE_DEBUG
   CGD_(clo).verbose = 0;
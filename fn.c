@@ -200,12 +200,19 @@ static Bool search_runtime_resolve(obj_node* obj)
 /*--- Object/File/Function hash entry operations           ---*/
 /*------------------------------------------------------------*/
 
-/* Object hash table, fixed */
-static obj_node* obj_table[N_OBJ_ENTRIES];
+/* Object hash table, grows with the number of objects */
+static obj_node** obj_table = 0;
+static UInt obj_table_size = 0;
+static UInt obj_table_count = 0;
 
 void CGD_(init_obj_table)() {
 	Int i;
-	for (i = 0; i < N_OBJ_ENTRIES; i++)
+
+	obj_table_size = N_OBJ_ENTRIES;
+	obj_table_count = 0;
+	obj_table = (obj_node**) CGD_MALLOC("cgd.fn.iot.1",
+					obj_table_size * sizeof(obj_node*));
+	for (i = 0; i < obj_table_size; i++)
 		obj_table[i] = 0;
 }
 
@@ -224,7 +231,7 @@ void delete_file_node(file_node* f_n) {
 	CGD_ASSERT(f_n != 0);
 
 	CGD_FREE(f_n->name);
-	for (j = 0; j < N_FN_ENTRIES; j++) {
+	for (j = 0; j < f_n->fns_size; j++) {
 		fn_node* fn_n = f_n->fns[j];
 		while (fn_n) {
 			fn_node* fn_n_next = fn_n->next;
@@ -232,6 +239,7 @@ void delete_file_node(file_node* f_n) {
 			fn_n = fn_n_next;
 		}
 	}
+	CGD_FREE(f_n->fns);
 
 	CGD_DATA_FREE(f_n, sizeof(file_node));
 }
@@ -244,7 +252,7 @@ void delete_obj_node(obj_node* obj) {
 	CGD_ASSERT(obj->name != 0);
 
 	CGD_FREE(obj->name);
-	for (i = 0; i < N_FILE_ENTRIES; i++) {
+	for (i = 0; i < obj->files_size; i++) {
 		file_node* f_n = obj->files[i];
 		while (f_n) {
 			file_node* f_n_next = f_n->next;
@@ -252,6 +260,7 @@ void delete_obj_node(obj_node* obj) {
 			f_n = f_n_next;
 		}
 	}
+	CGD_FREE(obj->files);
 
 	CGD_DATA_FREE(obj, sizeof(obj_node));
 }
@@ -259,33 +268,122 @@ void delete_obj_node(obj_node* obj) {
 void CGD_(destroy_obj_table)() {
 	Int i;
 
-	for (i = 0; i < N_OBJ_ENTRIES; i++) {
+	for (i = 0; i < obj_table_size; i++) {
 		obj_node* obj = obj_table[i];
 		while (obj) {
 			obj_node* next = obj->next;
 			delete_obj_node(obj);
 			obj = next;
 		}
-
-		obj_table[i] = 0;
 	}
-}
 
-#define HASH_CONSTANT   256
+	CGD_FREE(obj_table);
+	obj_table = 0;
+	obj_table_size = 0;
+	obj_table_count = 0;
+}
 
-static UInt str_hash(const HChar *s, UInt table_size)
+/* FNV-1a. The full hash is kept in each node, so lookups only compare
+ * names with a matching hash and resizing never rehashes the strings.
+ * Table sizes are powers of 2, the bucket is the hash masked. */
+static UInt str_hash(const HChar *s)
 {
-    int hash_value = 0;
+    UInt hash_value = 2166136261u;
     for ( ; *s; s++)
-        hash_value = (HASH_CONSTANT * hash_value + *s) % table_size;
+        hash_value = (hash_value ^ (UChar) *s) * 16777619u;
     return hash_value;
 }
 
+#define STR_HASH_IDX(hash, size)  ((hash) & ((size) - 1))
+
+/* The tables below are chained and double when there are more
+ * entries than buckets. The chains are relinked in place. */
+static
+void resize_obj_table(void) {
+	Int i;
+	UInt new_size = 2 * obj_table_size;
+	obj_node** new_table = (obj_node**) CGD_MALLOC("cgd.fn.rot.1",
+					new_size * sizeof(obj_node*));
+
+	for (i = 0; i < new_size; i++)
+		new_table[i] = 0;
+
+	for (i = 0; i < obj_table_size; i++) {
+		obj_node* obj = obj_table[i];
+		while (obj) {
+			obj_node* next = obj->next;
+			UInt idx = STR_HASH_IDX(obj->hash, new_size);
+
+			obj->next = new_table[idx];
+			new_table[idx] = obj;
+			obj = next;
+		}
+	}
+
+	CGD_FREE(obj_table);
+	obj_table = new_table;
+	obj_table_size = new_size;
+}
+
+static
+void resize_file_table(obj_node* obj) {
+	Int i;
+	UInt new_size = 2 * obj->files_size;
+	file_node** new_table = (file_node**) CGD_MALLOC("cgd.fn.rft.1",
+					new_size * sizeof(file_node*));
+
+	for (i = 0; i < new_size; i++)
+		new_table[i] = 0;
+
+	for (i = 0; i < obj->files_size; i++) {
+		file_node* file = obj->files[i];
+		while (file) {
+			file_node* next = file->next;
+			UInt idx = STR_HASH_IDX(file->hash, new_size);
+
+			file->next = new_table[idx];
+			new_table[idx] = file;
+			file = next;
+		}
+	}
+
+	CGD_FREE(obj->files);
+	obj->files = new_table;
+	obj->files_size = new_size;
+}
+
+static
+void resize_fn_table(file_node* file) {
+	Int i;
+	UInt new_size = 2 * file->fns_size;
+	fn_node** new_table = (fn_node**) CGD_MALLOC("cgd.fn.rfnt.1",
+					new_size * sizeof(fn_node*));
+
+	for (i = 0; i < new_size; i++)
+		new_table[i] = 0;
+
+	for (i = 0; i < file->fns_size; i++) {
+		fn_node* fn = file->fns[i];
+		while (fn) {
+			fn_node* next = fn->next;
+			UInt idx = STR_HASH_IDX(fn->hash, new_size);
+
+			fn->next = new_table[idx];
+			new_table[idx] = fn;
+			fn = next;
+		}
+	}
+
+	CGD_FREE(file->fns);
+	file->fns = new_table;
+	file->fns_size = new_size;
+}
+
 
 static const HChar* anonymous_obj = "???";
 
 static __inline__ 
-obj_node* new_obj_node(DebugInfo* di, obj_node* next)
+obj_node* new_obj_node(DebugInfo* di, UInt hash, obj_node* next)
 {
    Int i;
    obj_node* obj;
@@ -294,7 +392,12 @@ obj_node* new_obj_node(DebugInfo* di, obj_node* next)
    obj->name  = CGD_STRDUP("cgd.fn.non.2",
 		   	   	   di ? VG_(DebugInfo_get_filename)(di) : anonymous_obj);
 
-   for (i = 0; i < N_FILE_ENTRIES; i++) {
+   obj->hash  = hash;
+   obj->files_size  = N_FILE_ENTRIES;
+   obj->files_count = 0;
+   obj->files = (file_node**) CGD_MALLOC("cgd.fn.non.3",
+				obj->files_size * sizeof(file_node*));
+   for (i = 0; i < obj->files_size; i++) {
       obj->files[i] = NULL;
    }
    CGD_(stat).distinct_objs ++;
@@ -329,15 +432,22 @@ obj_node* CGD_(get_obj_node)(DebugInfo* di)
     obj_name = di ? VG_(DebugInfo_get_filename)(di) : anonymous_obj;
 
     /* lookup in obj hash */
-    objname_hash = str_hash(obj_name, N_OBJ_ENTRIES);
-    curr_obj_node = obj_table[objname_hash];
+    objname_hash = str_hash(obj_name);
+    curr_obj_node = obj_table[STR_HASH_IDX(objname_hash, obj_table_size)];
     while (NULL != curr_obj_node && 
-	   VG_(strcmp)(obj_name, curr_obj_node->name) != 0) {
+	   (curr_obj_node->hash != objname_hash ||
+	    VG_(strcmp)(obj_name, curr_obj_node->name) != 0)) {
 	curr_obj_node = curr_obj_node->next;
     }
     if (NULL == curr_obj_node) {
-	obj_table[objname_hash] = curr_obj_node = 
-	    new_obj_node(di, obj_table[objname_hash]);
+	UInt idx;
+
+	if (++obj_table_count > obj_table_size)
+	    resize_obj_table();
+
+	idx = STR_HASH_IDX(objname_hash, obj_table_size);
+	obj_table[idx] = curr_obj_node =
+	    new_obj_node(di, objname_hash, obj_table[idx]);
     }
 
     return curr_obj_node;
@@ -345,14 +455,19 @@ obj_node* CGD_(get_obj_node)(DebugInfo* di)
 
 
 static __inline__ 
-file_node* new_file_node(const HChar *filename,
+file_node* new_file_node(const HChar *filename, UInt hash,
 			 obj_node* obj, file_node* next)
 {
   Int i;
   file_node* file = (file_node*) CGD_MALLOC("cgd.fn.nfn.1",
                                            sizeof(file_node));
   file->name  = CGD_STRDUP("cgd.fn.nfn.2", filename);
-  for (i = 0; i < N_FN_ENTRIES; i++) {
+  file->hash  = hash;
+  file->fns_size  = N_FN_ENTRIES;
+  file->fns_count = 0;
+  file->fns = (fn_node**) CGD_MALLOC("cgd.fn.nfn.3",
+				file->fns_size * sizeof(fn_node*));
+  for (i = 0; i < file->fns_size; i++) {
     file->fns[i] = NULL;
   }
   CGD_(stat).distinct_files++;
@@ -378,16 +493,24 @@ file_node* CGD_(get_file_node)(obj_node* curr_obj_node,
     VG_(strcat)(filename, file);
 
     /* lookup in file hash */
-    filename_hash = str_hash(filename, N_FILE_ENTRIES);
-    curr_file_node = curr_obj_node->files[filename_hash];
+    filename_hash = str_hash(filename);
+    curr_file_node = curr_obj_node->files[
+		STR_HASH_IDX(filename_hash, curr_obj_node->files_size)];
     while (NULL != curr_file_node && 
-	   VG_(strcmp)(filename, curr_file_node->name) != 0) {
+	   (curr_file_node->hash != filename_hash ||
+	    VG_(strcmp)(filename, curr_file_node->name) != 0)) {
 	curr_file_node = curr_file_node->next;
     }
     if (NULL == curr_file_node) {
-	curr_obj_node->files[filename_hash] = curr_file_node = 
-	    new_file_node(filename, curr_obj_node, 
-			  curr_obj_node->files[filename_hash]);
+	UInt idx;
+
+	if (++curr_obj_node->files_count > curr_obj_node->files_size)
+	    resize_file_table(curr_obj_node);
+
+	idx = STR_HASH_IDX(filename_hash, curr_obj_node->files_size);
+	curr_obj_node->files[idx] = curr_file_node =
+	    new_file_node(filename, filename_hash, curr_obj_node,
+			  curr_obj_node->files[idx]);
     }
 
     return curr_file_node;
@@ -395,12 +518,13 @@ file_node* CGD_(get_file_node)(obj_node* curr_obj_node,
 
 /* forward decl. */
 static __inline__ 
-fn_node* new_fn_node(const HChar *fnname,
+fn_node* new_fn_node(const HChar *fnname, UInt hash,
 		     file_node* file, fn_node* next)
 {
     fn_node* fn = (fn_node*) CGD_MALLOC("cgd.fn.nfnnd.1",
                                          sizeof(fn_node));
     fn->name = CGD_STRDUP("cgd.fn.nfnnd.2", fnname);
+    fn->hash = hash;
 
     CGD_(stat).distinct_fns++;
     fn->number   = CGD_(stat).distinct_fns;
@@ -433,16 +557,24 @@ fn_node* get_fn_node_infile(file_node* curr_file_node,
     CGD_ASSERT(curr_file_node != 0);
 
     /* lookup in function hash */
-    fnname_hash = str_hash(fnname, N_FN_ENTRIES);
-    curr_fn_node = curr_file_node->fns[fnname_hash];
+    fnname_hash = str_hash(fnname);
+    curr_fn_node = curr_file_node->fns[
+		STR_HASH_IDX(fnname_hash, curr_file_node->fns_size)];
     while (NULL != curr_fn_node && 
-	   VG_(strcmp)(fnname, curr_fn_node->name) != 0) {
+	   (curr_fn_node->hash != fnname_hash ||
+	    VG_(strcmp)(fnname, curr_fn_node->name) != 0)) {
 	curr_fn_node = curr_fn_node->next;
     }
     if (NULL == curr_fn_node) {
-	curr_file_node->fns[fnname_hash] = curr_fn_node = 
-            new_fn_node(fnname, curr_file_node,
-			curr_file_node->fns[fnname_hash]);
+	UInt idx;
+
+	if (++curr_file_node->fns_count > curr_file_node->fns_size)
+	    resize_fn_table(curr_file_node);
+
+	idx = STR_HASH_IDX(fnname_hash, curr_file_node->fns_size);
+	curr_file_node->fns[idx] = curr_fn_node =
+            new_fn_node(fnname, fnname_hash, curr_file_node,
+			curr_file_node->fns[idx]);
     }
 
     return curr_fn_node;
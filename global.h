@@ -41,6 +41,7 @@
 #include "pub_tool_libcproc.h"
 #include "pub_tool_machine.h"
 #include "pub_tool_mallocfree.h"
+#include "pub_tool_poolalloc.h"
 #include "pub_tool_options.h"
 #include "pub_tool_tooliface.h"
 #include "pub_tool_xarray.h"
@@ -65,15 +66,56 @@
 // Enable profiling. Use 0 to disable.
 #define ENABLE_PROFILING  1
 
-// CFG node cache size. Use 0 to disable.
+// Default CFG node cache size (--node-cache-size). Use 0 to disable.
 #define CFG_NODE_CACHE_SIZE 8
 
+// Default CFG node cache associativity (--node-cache-ways).
+#define CFG_NODE_CACHE_WAYS 2
+
+// Most recent transitions kept by each BB exit, with the nodes they
+// reach and their counts. Use 0 to disable. It requires the CFG node cache.
+#define EXIT_TRANSITIONS 2
+
+#if EXIT_TRANSITIONS > 0 && CFG_NODE_CACHE_SIZE == 0
+#error "The exit transitions require the CFG node cache"
+#endif
+
+// Inline the common case of setup_bb in the instrumented code.
+// Use 0 to disable. It requires the exit transitions.
+#define SETUP_BB_FAST_PATH 1
+
+#if SETUP_BB_FAST_PATH && EXIT_TRANSITIONS == 0
+#error "The setup_bb fast path requires the exit transitions"
+#endif
+
+// Count the BB exits in the instrumented code, in their most recent
+// transition. Use 0 to disable. It requires profiling and the exit
+// transitions.
+#define INLINE_EXIT_COUNTS 1
+
+#if INLINE_EXIT_COUNTS && (!ENABLE_PROFILING || EXIT_TRANSITIONS == 0)
+#error "The inline exit counts require profiling and the exit transitions"
+#endif
+
+// Index the successors of a CFG node by address once it has this
+// many of them (switch tables, interpreter dispatch). Use 0 to disable.
+#define SUCC_INDEX_THRESHOLD 16
+
+// Index the calls of a CFG block by callee address once it has this
+// many of them (megamorphic indirect calls). Use 0 to disable.
+#define CALLS_INDEX_THRESHOLD 8
+
+// Allocate the CFG objects and the smart list headers from pools
+// with free lists. Use 0 to disable.
+#define POOL_ALLOC 1
+
 // Chain Smart List: 1
 // Realloc Smart List: 2
 #define SMART_LIST_MODE 2
 
-// Enable or disable data structure cells tracking
-// #define TRACKING_CELLS
+// Elements kept inside the header of a realloc smart list, the
+// elements array is only allocated for larger lists.
+#define SMART_LIST_INLINE_SIZE 4
 
 /*------------------------------------------------------------*/
 /*--- Command line options                                 ---*/
@@ -92,6 +134,11 @@ struct _CommandLineOptions {
   Bool ignore_profiling;    /* Ignore profiling information from input */
 #endif
   Bool emulate_calls;       /* Emulate calls for some jumps */
+  enum {
+	  CHECK_CFG_NONE,
+	  CHECK_CFG_DIRTY,
+	  CHECK_CFG_ALL
+  } check_cfg;              /* CFGs validated when loaded and at the end */
   struct {
 	  Bool all;             /* Dump all cfgs */
 	  SmartList* addrs;     /* List of cfg's addresses to dump */
@@ -100,6 +147,26 @@ struct _CommandLineOptions {
   } dump_cfgs;
   const HChar* instrs_map;   /* Instructions map input file */
   const HChar* mem_mappings; /* Runtime memory mappings output file */
+  const HChar* indirect_calls; /* Callees per indirect call site output file */
+#if ENABLE_PROFILING
+  struct {
+	  ULong on;             /* BBs profiled in each sampling burst */
+	  ULong off;            /* BBs skipped between bursts (0: no sampling) */
+  } sample;
+#endif
+#if !ENABLE_PROFILING
+  struct {
+	  Bool complete;        /* Freeze the complete and stable CFGs */
+	  Int after;            /* Executions without new structure before freezing */
+  } freeze;
+#endif
+#if CFG_NODE_CACHE_SIZE > 0
+  struct {
+	  Int size;             /* Entries of each node cache */
+	  Int ways;             /* Entries per set of each node cache */
+	  UInt sets_mask;       /* Number of sets minus one (set in post_clo_init) */
+  } node_cache;
+#endif
 
 #if CGD_ENABLE_DEBUG
   Int   verbose;
@@ -111,6 +178,21 @@ struct _CommandLineOptions {
 /*--- Statistics                                           ---*/
 /*------------------------------------------------------------*/
 
+#if CFG_NODE_CACHE_SIZE > 0
+typedef struct _CacheStatistics CacheStatistics;
+struct _CacheStatistics {
+  ULong hits;
+  ULong misses;
+  ULong evictions;  /* valid entries replaced on conflicts */
+  ULong flushes;    /* pending counts flushed to the CFG */
+};
+#endif
+
+/* Counters updated on the hot path (node caches, exit transitions): they
+ * are only reported with --stats, so they are not counted otherwise. */
+#define CGD_HOT_STAT(counter) \
+	do { if (UNLIKELY(VG_(clo_stats))) (counter)++; } while (0)
+
 typedef struct _Statistics Statistics;
 struct _Statistics {
   ULong bb_executions;
@@ -129,11 +211,44 @@ struct _Statistics {
   Int  call_stack_resizes;
   Int  cfg_hash_resizes;
   Int  instrs_pool_resizes;
+  Int  instr_refs_resizes;  /* of the instruction references of the CFGs */
+  Int  instrs_pages;      /* code pages in the instructions pool */
+  UInt hash_migrate_max;  /* most buckets migrated by one hash map operation */
 
   Int  full_debug_BBs;
   Int  file_line_debug_BBs;
   Int  fn_name_debug_BBs;
   Int  no_debug_BBs;
+
+  ULong phantom_records;  /* exits recorded for deferred phantom nodes */
+#if SUCC_INDEX_THRESHOLD > 0
+  Int  succ_indexes;      /* successors indexes built for high fan-out nodes */
+#endif
+#if CALLS_INDEX_THRESHOLD > 0
+  Int  calls_indexes;     /* calls indexes built for megamorphic call sites */
+#endif
+
+#if CFG_NODE_CACHE_SIZE > 0
+  CacheStatistics block_cache;
+  CacheStatistics call_cache;
+  CacheStatistics exit_cache;
+#if EXIT_TRANSITIONS > 0
+  CacheStatistics exit_trans;
+#endif
+#if ENABLE_PROFILING
+  ULong edge_count_flushes;  /* calls to CGD_(cfgnode_flush_edge_count) */
+  ULong edge_count_walks;    /* edges walked by these calls */
+#endif
+#endif
+#if SETUP_BB_FAST_PATH && ENABLE_PROFILING
+  ULong fast_path_hits;
+#endif
+#if ENABLE_PROFILING
+  ULong sample_resyncs;  /* execution states resynchronized in a burst */
+  ULong sample_misses;   /* BBs skipped while not synchronized */
+#else
+  Int  frozen_cfgs;      /* CFGs frozen (see --freeze-complete) */
+#endif
 };
 
 
@@ -149,6 +264,7 @@ typedef struct _call_entry			call_entry;
 typedef struct _thread_info			thread_info;
 typedef struct _CFG					CFG;
 typedef struct _CfgInstrRef			CfgInstrRef;
+typedef struct _CfgInstrRefs		CfgInstrRefs;
 typedef struct _CfgNode				CfgNode;
 typedef struct _CfgEdge				CfgEdge;
 typedef struct _CfgCall				CfgCall;
@@ -168,6 +284,15 @@ typedef enum {
   bjk_Return,
 } BBJumpKind;
 
+/* The shape of a BB, classified when it is instrumented, selects how
+ * its exits are processed when it is left (see CGD_(setup_bb)).
+ */
+typedef enum {
+  bbs_Generic = 0,     /* side exits in several instruction groups */
+  bbs_SingleGroup,     /* side exits, but a single instruction group */
+  bbs_NoSideExits,     /* only the final exit */
+} BBShape;
+
 typedef struct _InstrDesc InstrDesc;
 struct _InstrDesc {
 	HChar* name;
@@ -180,8 +305,6 @@ struct _UniqueInstr {
 	Int size;
 	HChar* name;
 	InstrDesc* desc;
-
-  UniqueInstr* chain;
 };
 
 /* 
@@ -205,6 +328,65 @@ struct _InstrGroupInfo {
 	} bb_info;
 };
 
+#if CFG_NODE_CACHE_SIZE > 0
+/*
+ * The node caches are set-associative: the entries of a set are
+ * kept from the most to the least recently used.
+ */
+typedef struct _CfgNodeBlockCache		CfgNodeBlockCache;
+struct _CfgNodeBlockCache {
+	Addr addr;
+	UInt size;
+#if ENABLE_PROFILING
+	ULong count;
+#endif
+	CfgNode* working;
+};
+
+typedef struct _CfgNodeCallCache		CfgNodeCallCache;
+struct _CfgNodeCallCache {
+	CFG* called;
+	Bool indirect;
+#if ENABLE_PROFILING
+	unsigned long long count;
+#endif
+};
+
+typedef struct _CfgNodeExitCache		CfgNodeExitCache;
+struct _CfgNodeExitCache {
+	Bool enabled;
+#if ENABLE_PROFILING
+	ULong count;
+#endif
+};
+#endif
+
+#if EXIT_TRANSITIONS > 0
+/*
+ * Transition through a BB exit: leaving the node src of a CFG, the
+ * working node goes through the remaining groups of the BB (known
+ * from the exit) up to mid and, for a jump into the BB next, through
+ * its first group (kept in case next is deleted) up to dst. Calls
+ * and returns only keep the first part (next is 0), since the node
+ * they reach depends on the call stack. With profiling, it counts
+ * its executions until it is evicted or the BB is deleted.
+ * The fields checked by the fast path fit in a cache line.
+ */
+typedef struct _CJmpTrans CJmpTrans;
+struct _CJmpTrans {
+	CFG* cfg;
+	CfgNode* src;
+	CfgNode* mid;
+	CfgNode* dst;
+	BB* next;
+	Addr next_addr;
+	UInt next_size;
+#if ENABLE_PROFILING
+	ULong count;
+#endif
+};
+#endif
+
 /*
  * Info for a side exit in a BB
  */
@@ -215,7 +397,33 @@ struct _CJmpInfo {
 	BBJumpKind jmpkind; /* jump kind when leaving BB at this side exit */
 	Addr dst;            /* Destination addr (nil if call or ret) */
 	Bool indirect;       /* Mark if it is an indirect jump */
+	CfgNode* recorded;   /* last working node this exit was recorded in */
+#if EXIT_TRANSITIONS > 0
+	CJmpTrans trans[EXIT_TRANSITIONS]; /* most recent transitions first */
+#endif
+};
+
+#if SETUP_BB_FAST_PATH
+/*
+ * Expected transition for the inline fast path of setup_bb: when the
+ * previous BB (last_bb) was left through the exit passed, it is the
+ * most recent transition of that exit (jmp), if it leaves the working
+ * node and leads into this BB.
+ * The fast path is disabled while passed is negative, and until it is
+ * set again once any BB is deleted (gen is not CGD_(bb_generation)),
+ * since a new BB may reuse the address of last_bb. It is only replaced
+ * by another exit after consecutive misses (reset on each hit).
+ * With INLINE_EXIT_COUNTS, the exit must also have been counted.
+ */
+typedef struct _BBFastPath BBFastPath;
+struct _BBFastPath {
+	BB* last_bb;
+	Int passed;
+	UInt gen;
+	UInt misses;
+	CJmpInfo* jmp;
 };
+#endif
 
 /**
  * An instrumented basic block (BB).
@@ -232,7 +440,6 @@ struct _CJmpInfo {
 struct _BB {
   obj_node*  obj;         /* ELF object of BB */
   PtrdiffT   offset;      /* offset of BB in ELF object file */
-  BB*        next;       /* chaining for a hash entry */
 
   VgSectKind sect_kind;  /* section of this BB, e.g. PLT */
   UInt       instr_count;
@@ -250,6 +457,12 @@ struct _BB {
 
   InstrGroupInfo* groups; /* array of instruction groups. */
   UInt groups_count;      /* number of groups */
+  BBShape    shape;       /* shape of the exits of this BB */
+  CFG*       cfg;         /* CFG of the first group address (see bb_cfg) */
+
+#if SETUP_BB_FAST_PATH
+  BBFastPath fast;        /* expected transition into this BB */
+#endif
 
   UInt       instr_len;
   InstrInfo  instr[0];   /* info on instruction sizes and costs */
@@ -261,6 +474,7 @@ struct _BB {
 struct _fn_node {
   HChar*     name;
   UInt       number;
+  UInt       hash;     /* full hash of <name> */
   Bool		visited;
   file_node* file;     /* reverse mapping for 2nd hash */
   fn_node* next;
@@ -274,15 +488,20 @@ struct _fn_node {
 #endif
 };
 
-/* Quite arbitrary fixed hash sizes */
+/* Initial hash sizes (powers of 2). A table doubles as soon as it
+ * holds more entries than buckets, so chains stay short even for
+ * objects with a huge number of functions. */
 
-#define   N_OBJ_ENTRIES         47
-#define  N_FILE_ENTRIES         53
-#define    N_FN_ENTRIES         87
+#define   N_OBJ_ENTRIES         64
+#define  N_FILE_ENTRIES         16
+#define    N_FN_ENTRIES         64
 
 struct _file_node {
    HChar*     name;
-   fn_node*   fns[N_FN_ENTRIES];
+   UInt       hash;      /* full hash of <name> */
+   fn_node**  fns;
+   UInt       fns_size;  /* buckets in <fns> */
+   UInt       fns_count; /* functions in this file */
    UInt       number;
    obj_node*  obj;
    file_node* next;
@@ -300,9 +519,12 @@ struct _obj_node {
    SizeT      size;   /* Length of mapping */
    PtrdiffT   offset; /* Offset between symbol address and file offset */
 
-   file_node* files[N_FILE_ENTRIES];
-   UInt       number;
-   obj_node*  next;
+   UInt        hash;        /* full hash of <name> */
+   file_node** files;
+   UInt        files_size;  /* buckets in <files> */
+   UInt        files_count; /* files in this object */
+   UInt        number;
+   obj_node*   next;
 };
 
 /* an entry in the callstack */
@@ -335,7 +557,8 @@ struct _exec_state {
   /* the old call stack pointer at entering the signal handler */
   Int orig_sp;
   
-  /* number of conditional jumps passed in last BB */
+  /* number of conditional jumps passed in last BB
+   * (with JMPS_PASSED_COUNTED if the exit was counted inline) */
   Int   jmps_passed;
   BB*   bb;      /* last BB executed */
 
@@ -343,7 +566,33 @@ struct _exec_state {
 
   CFG* cfg;
   CfgNode* working;
+
+#if ENABLE_PROFILING
+  UInt burst;    /* sampling burst this state is synchronized in */
+#endif
+};
+
+#if INLINE_EXIT_COUNTS
+/* Set in jmps_passed by the instrumented code when it also incremented
+ * the count of the exit taken. It is not set if the BB was left
+ * abnormally (signal, fault) or while not counting (--sample). */
+#define JMPS_PASSED_COUNTED   (1 << 30)
+#endif
+
+#if ENABLE_PROFILING
+/*
+ * Bursty sampling (--sample=on:off): the instrumented code decrements
+ * left in every BB and only profiles the BBs executed while it is below
+ * the burst length. The burst ends when left reaches 0 and the state of
+ * each thread must be synchronized again in the next burst.
+ */
+typedef struct _SampleState SampleState;
+struct _SampleState {
+  ULong left;    /* BBs left until the end of the period */
+  UInt burst;    /* number of the current (or last) burst */
+  Bool off;      /* between bursts */
 };
+#endif
 
 enum CfgNodeType {
 	CFG_ENTRY,
@@ -353,78 +602,57 @@ enum CfgNodeType {
 	CFG_HALT
 };
 
+/* The lists that hold an edge: the successors of its source
+ * and the predecessors of its destination. */
+enum CfgEdgeList {
+	EDGE_SUCC_LIST,
+	EDGE_PRED_LIST,
+	EDGE_LISTS
+};
+
 struct _CFG {
 	Addr addr;				// CFG address
 	FunctionDesc* fdesc;		// debugging info for this CFG
 
 	Bool dirty;				// true if new nodes are added during analysis
 	Bool visited;			// used to use in search algorithms
+#if !ENABLE_PROFILING
+	Bool frozen;			// its BBs do not call setup_bb (--freeze-complete)
+	Int stable;				// executions since its structure last changed
+#endif
 
 	CfgNode* entry;			// cfg entry node
 	CfgNode* exit;			// cfg exit node (if exists).
 	CfgNode* halt;			// cfg halt node (if exists).
 	SmartList* nodes;		// SmartList<CfgNode*>
-	SmartList* edges;		// SmartList<Edge*>
+
 
 	struct {
-		SmartHash* refs;		// SmartHash<CfgInstrRef*>, index by instruction address
+		CfgInstrRefs* refs;		// instruction address => (node, index)
 	} cache;
 
 	struct {
 		Int blocks;
-		Int phantoms;
+		Int phantoms;			// including the deferred ones
+		Int deferred;			// exits recorded to addresses not in the CFG
 		Int indirects;
 #if ENABLE_PROFILING
 		ULong execs;
 #endif
-	} stats;
-
-	CFG* chain;				// entry chain in hash
-};
-
 #if CFG_NODE_CACHE_SIZE > 0
-#define CFG_NODE_CACHE_INDEX(addr) (addr % CFG_NODE_CACHE_SIZE)
-
-typedef struct _CfgNodeBlockCache		CfgNodeBlockCache;
-struct _CfgNodeBlockCache {
-	Addr addr;
-	UInt size;
-#if ENABLE_PROFILING
-	ULong count;
-#endif
-	CfgNode* working;
-};
-
-typedef struct _CfgNodePhantomCache		CfgNodePhantomCache;
-struct _CfgNodePhantomCache {
-	Addr addr;
-	Bool indirect;
-};
-
-typedef struct _CfgNodeCallCache		CfgNodeCallCache;
-struct _CfgNodeCallCache {
-	CFG* called;
-	Bool indirect;
-#if ENABLE_PROFILING
-	unsigned long long count;
-#endif
-};
-
-typedef struct _CfgNodeExitCache		CfgNodeExitCache;
-struct _CfgNodeExitCache {
-	Bool enabled;
-#if ENABLE_PROFILING
-	ULong count;
+		ULong cache_misses;
 #endif
+	} stats;
 };
-#endif
 
 struct _CfgNode {
 	Int id;
+	Int idx;				// position in the CFG nodes, -1 if none
 	enum CfgNodeType type;
+	Bool visited;				// mark of visited node
 
 	union {
-		CfgInstrRef* phantom;	/* Phantom instruction */
+		UniqueInstr* phantom;	/* Phantom instruction */
 		CfgBlock* block;		/* Block node's block */
 	} data;
 
@@ -432,26 +660,30 @@ struct _CfgNode {
 		Bool has_fallthrough;
 		SmartList* successors;   /* SmartList<CfgEdge*> */
 		SmartList* predecessors; /* SmartList<CfgEdge*> */
+		SmartList* exits;        /* SmartList<Addr>, targets of deferred phantoms */
+#if SUCC_INDEX_THRESHOLD > 0
+		SmartHash* succ_index;   /* SmartHash<CfgEdge*>, by successor address */
+#endif
 	} info;
 
 #if CFG_NODE_CACHE_SIZE > 0
 	struct  {
-		CfgNodeBlockCache* block;     // CfgNodeBlockCache block[CFG_NODE_CACHE_SIZE];
-		CfgNodePhantomCache* phantom; // CfgNodePhantomCache phantom[CFG_NODE_CACHE_SIZE];
-		CfgNodeCallCache* call;       // CfgNodeCallCache call[CFG_NODE_CACHE_SIZE];
+		CfgNodeBlockCache* block;     // CfgNodeBlockCache block[CGD_(clo).node_cache.size];
+		CfgNodeCallCache* call;       // CfgNodeCallCache call[CGD_(clo).node_cache.size];
 		CfgNodeExitCache exit;
 	} cache;
 #endif
-
-	Bool visited;				// mark of visited node
 };
 
+// An edge is only held by the lists of its nodes, so the
+// successors of the CFG nodes reach all of its edges.
 struct _CfgEdge {
 	CfgNode* src;
 	CfgNode* dst;
 #if ENABLE_PROFILING
 	ULong count;
 #endif
+	Int idx[EDGE_LISTS];	// positions in the lists that hold it
 };
 
 typedef struct _SmartValue SmartValue;
@@ -461,25 +693,226 @@ struct _SmartValue {
 	SmartValue* next;
 };
 
-/* Global state structures */
-typedef struct _bb_hash bb_hash;
-struct _bb_hash {
-  UInt size, entries;
-  BB** table;
+/*------------------------------------------------------------*/
+/*--- Hash maps                                            ---*/
+/*------------------------------------------------------------*/
+
+/* Open addressing map with linear probing: a power of 2 table of
+ * (key, value) entries, where a null value marks an empty entry.
+ * The keys are kept inline, so a probe does not touch the values.
+ *
+ * A full map is rehashed incrementally: the doubled table is allocated
+ * and each following get or put moves a few entries of the old one,
+ * which is still searched until it is drained. Removals and walks, both
+ * rare, finish the migration first.
+ *
+ * HASH_MAP_TYPE(name, key_t, type) declares the map type, and
+ * HASH_MAP_FUNCS(name, key_t, type, hash, eq, cc, resizes) its
+ * functions, with hash(key, bits) the index of a key and eq(k1, k2)
+ * the keys equality:
+ *   name##_init(map, bits), name##_destroy(map)
+ *   name##_get(map, key)
+ *   name##_put(map, key, value), returns the replaced value
+ *   name##_remove(map, key), returns the removed value
+ * Walk it with name##_at(map, i) for i in [0, map->size), after
+ * name##_finish(map).
+ */
+#define HASH_MAP_MIGRATE_STEP 16
+
+#define HASH_MAP_TYPE(name, key_t, type)                                \
+	typedef struct {                                                    \
+		key_t key;                                                      \
+		type* value;                                                    \
+	} name##_entry;                                                     \
+	typedef struct {                                                    \
+		UInt size, bits, entries;                                       \
+		name##_entry* table;                                            \
+		struct {                                                        \
+			UInt size, bits, next;                                      \
+			name##_entry* table; /* being migrated, 0 if none */        \
+		} old;                                                          \
+	} name;
+
+#define HASH_MAP_FUNCS(name, key_t, type, hash, eq, cc, resizes)        \
+static __inline__                                                       \
+name##_entry* name##_find(name##_entry* table, UInt bits, key_t key) {  \
+	UInt idx = hash(key, bits);                                         \
+	while (table[idx].value && !eq(table[idx].key, key))                \
+		idx = (idx + 1) & ((1 << bits) - 1);                            \
+	return &(table[idx]);                                               \
+}                                                                       \
+static __inline__                                                       \
+name##_entry* name##_slot(name* map, key_t key) {                       \
+	return name##_find(map->table, map->bits, key);                     \
+}                                                                       \
+static __inline__                                                       \
+void name##_alloc(name* map, UInt bits) {                               \
+	CGD_ASSERT(bits > 0 && bits < 32);                                  \
+	map->bits = bits;                                                   \
+	map->size = 1 << bits;                                              \
+	map->table = (name##_entry*) CGD_MALLOC(cc,                         \
+				(map->size * sizeof(name##_entry)));                    \
+	VG_(memset)(map->table, 0, (map->size * sizeof(name##_entry)));     \
+}                                                                       \
+static __inline__                                                       \
+void name##_init(name* map, UInt bits) {                                \
+	VG_(memset)(map, 0, sizeof(name));                                  \
+	name##_alloc(map, bits);                                            \
+}                                                                       \
+static __inline__                                                       \
+void name##_destroy(name* map) {                                        \
+	CGD_ASSERT(map->entries == 0);                                      \
+	if (map->old.table)                                                 \
+		CGD_FREE(map->old.table);                                       \
+	CGD_FREE(map->table);                                               \
+	VG_(memset)(map, 0, sizeof(name));                                  \
+}                                                                       \
+/* Move up to count entries of the old table, unless they were */      \
+/* replaced in the new one meanwhile. */                                \
+static __inline__                                                       \
+void name##_migrate(name* map, UInt count) {                            \
+	UInt moved = 0;                                                     \
+	while (map->old.table && moved < count) {                           \
+		name##_entry* entry = &(map->old.table[map->old.next]);         \
+		if (entry->value) {                                             \
+			name##_entry* dst = name##_slot(map, entry->key);           \
+			if (!dst->value)                                            \
+				*dst = *entry;                                          \
+		}                                                               \
+		if (++map->old.next == map->old.size) {                         \
+			CGD_FREE(map->old.table);                                   \
+			VG_(memset)(&(map->old), 0, sizeof(map->old));              \
+		}                                                               \
+		moved++;                                                        \
+	}                                                                   \
+	if (moved > 0)                                                      \
+		hash_map_migrated(moved);                                       \
+}                                                                       \
+static __inline__                                                       \
+void name##_finish(name* map) {                                         \
+	if (map->old.table)                                                 \
+		name##_migrate(map, map->old.size);                             \
+}                                                                       \
+static __inline__                                                       \
+void name##_resize(name* map) {                                         \
+	name##_finish(map);                                                 \
+	map->old.table = map->table;                                        \
+	map->old.size = map->size;                                          \
+	map->old.bits = map->bits;                                          \
+	map->old.next = 0;                                                  \
+	name##_alloc(map, map->bits + 1);                                   \
+	resizes++;                                                          \
+}                                                                       \
+static __inline__                                                       \
+type* name##_at(name* map, UInt i) {                                    \
+	CGD_ASSERT(map->old.table == 0);                                    \
+	return map->table[i].value;                                         \
+}                                                                       \
+static __inline__                                                       \
+type* name##_get(name* map, key_t key) {                                \
+	name##_entry* entry;                                                \
+	if (UNLIKELY(map->old.table != 0)) {                                \
+		name##_migrate(map, HASH_MAP_MIGRATE_STEP);                     \
+		entry = name##_slot(map, key);                                  \
+		if (!entry->value && map->old.table)                            \
+			entry = name##_find(map->old.table, map->old.bits, key);    \
+	} else {                                                            \
+		entry = name##_slot(map, key);                                  \
+	}                                                                   \
+	return entry->value;                                                \
+}                                                                       \
+static __inline__                                                       \
+type* name##_put(name* map, key_t key, type* value) {                   \
+	type* old;                                                          \
+	name##_entry* entry;                                                \
+	CGD_ASSERT(value != 0);                                             \
+	name##_migrate(map, HASH_MAP_MIGRATE_STEP);                         \
+	entry = name##_slot(map, key);                                      \
+	if ((old = entry->value)) {                                         \
+		entry->value = value;                                           \
+		return old;                                                     \
+	}                                                                   \
+	/* not migrated yet, it takes precedence over the old entry */      \
+	if (map->old.table &&                                               \
+		(old = name##_find(map->old.table, map->old.bits, key)->value)) { \
+		entry->key = key;                                               \
+		entry->value = value;                                           \
+		return old;                                                     \
+	}                                                                   \
+	/* keep the load factor up to 70% */                                \
+	if (10 * (map->entries + 1) > 7 * map->size) {                      \
+		name##_resize(map);                                             \
+		entry = name##_slot(map, key);                                  \
+	}                                                                   \
+	entry->key = key;                                                   \
+	entry->value = value;                                               \
+	map->entries++;                                                     \
+	return 0;                                                           \
+}                                                                       \
+static __inline__                                                       \
+type* name##_remove(name* map, key_t key) {                             \
+	UInt hole, idx, home;                                               \
+	type* old;                                                          \
+	name##_entry* entry;                                                \
+	name##_finish(map);                                                 \
+	entry = name##_slot(map, key);                                      \
+	if (!(old = entry->value))                                          \
+		return 0;                                                       \
+	/* shift back the entries not found from their home anymore */      \
+	hole = idx = entry - map->table;                                    \
+	while (True) {                                                      \
+		idx = (idx + 1) & (map->size - 1);                              \
+		if (!map->table[idx].value)                                     \
+			break;                                                      \
+		home = hash(map->table[idx].key, map->bits);                    \
+		if (((idx - home) & (map->size - 1)) >=                         \
+				((idx - hole) & (map->size - 1))) {                     \
+			map->table[hole] = map->table[idx];                         \
+			hole = idx;                                                 \
+		}                                                               \
+	}                                                                   \
+	VG_(memset)(&(map->table[hole]), 0, sizeof(name##_entry));          \
+	map->entries--;                                                     \
+	return old;                                                         \
+}
+
+/* Multiplicative (Fibonacci) hashing of an address: the high bits of
+ * the product depend on all the key bits, so aligned addresses do not
+ * cluster as they do with a modulo. */
+static __inline__
+UInt addr_hash_idx(Addr key, UInt bits) {
+	return (UInt) (((ULong) key * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+#define ADDR_EQ(k1, k2) ((k1) == (k2))
+
+/* BBs are keyed by their object and offset in it. */
+typedef struct _BBKey BBKey;
+struct _BBKey {
+	obj_node* obj;
+	PtrdiffT offset;
 };
 
+static __inline__
+UInt bb_key_hash_idx(BBKey key, UInt bits) {
+	return addr_hash_idx(((Addr) key.obj) + key.offset, bits);
+}
+
+#define BB_KEY_EQ(k1, k2) ((k1).obj == (k2).obj && (k1).offset == (k2).offset)
+
+/* Global state structures */
+HASH_MAP_TYPE(bb_hash, BBKey, BB)
+
+
 typedef struct _call_stack call_stack;
 struct _call_stack {
   UInt size;
   Int sp;
   call_entry* entry;
+  Addr top_sp;  /* SP of the top entry (~0 if empty) */
 };
 
-typedef struct _cfg_hash cfg_hash;
-struct _cfg_hash {
-  UInt size, entries;
-  CFG** table;
-};
+HASH_MAP_TYPE(cfg_hash, Addr, CFG)
 
 /* The maximum number of simultaneous running signal handlers per thread.
  * This is the number of execution states storable in a thread.
@@ -515,6 +948,12 @@ bb_hash* CGD_(get_bb_hash)(void);
 BB*  CGD_(get_bb)(Addr addr, IRSB* bb_in, Bool *seen_before);
 void CGD_(delete_bb)(Addr addr);
 void CGD_(setup_bb)(BB* bb) VG_REGPARM(1);
+#if ENABLE_PROFILING && EXIT_TRANSITIONS > 0
+void CGD_(bb_flush_all_counts)(void);
+#endif
+#if INLINE_EXIT_COUNTS
+void CGD_(bb_uncount_exit)(BB* bb, Int jmps_passed);
+#endif
 
 static __inline__ Addr bb_addr(BB* bb)
  { return bb->offset + bb->obj->offset; }
@@ -529,6 +968,9 @@ CFG* CGD_(get_cfg)(Addr addr);
 Addr CGD_(cfg_addr)(CFG* cfg);
 FunctionDesc* CGD_(cfg_fdesc)(CFG* cfg);
 void CGD_(cfg_build_fdesc)(CFG* cfg);
+#if CFG_NODE_CACHE_SIZE > 0
+ULong CGD_(cfg_cache_misses)(CFG* cfg);
+#endif
 Bool CGD_(cfg_is_dirty)(CFG* cfg);
 Bool CGD_(cfg_is_visited)(CFG* cfg);
 void CGD_(cfg_set_visited)(CFG* cfg, Bool visited);
@@ -550,19 +992,26 @@ void CGD_(cfgnode_set_visited)(CfgNode* node, Bool visited);
 Bool CGD_(cfgnode_is_indirect)(CfgNode* node);
 void CGD_(cfgnode_remove_successor_with_addr)(CFG* cfg, CfgNode* node, Addr addr);
 Bool CGD_(cfgnodes_cmp)(CfgNode* node1, CfgNode* node2);
+#if ENABLE_PROFILING
+CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_offset, ULong count);
+#else
 CfgNode* CGD_(cfgnode_set_block)(CFG* cfg, CfgNode* working, BB* bb, Int group_offset);
-void CGD_(cfgnode_set_phantom)(CFG* cfg, CfgNode* working, Addr to,
+#endif
+void CGD_(cfgnode_record_exit)(CFG* cfg, CfgNode* working, Addr to,
 		BBJumpKind jmpkind, Bool indirect);
+void CGD_(cfg_materialize_phantoms)(CFG* cfg);
 void CGD_(cfgnode_set_call)(CFG* cfg, CfgNode* working, CFG* call, Bool indirect);
 void CGD_(cfgnode_set_signal_handler)(CFG* cfg, CfgNode* working, CFG* called, Int signum);
 CfgNode* CGD_(cfgnode_set_exit)(CFG* cfg, CfgNode* working);
 CfgNode* CGD_(cfgnode_set_halt)(CFG* cfg, CfgNode* working);
+CfgNode* CGD_(cfg_find_block)(CFG* cfg, BB* bb);
 void CGD_(clean_visited_cfgnodes)(CFG* cfg);
 void CGD_(fix_cfg)(CFG* cfg);
 void CGD_(check_cfg)(CFG* cfg);
 void CGD_(fprint_cfg)(VgFile* out, CFG* cfg);
 void CGD_(fprint_detailed_cfg)(VgFile* out, CFG* cfg);
 void CGD_(write_cfgs)(const HChar* filename);
+void CGD_(write_indirect_calls)(const HChar* filename);
 void CGD_(read_cfgs)(Int fd);
 void CGD_(dump_cfg)(CFG* cfg);
 void CGD_(forall_cfg)(void (*func)(CFG*));
@@ -572,6 +1021,14 @@ void CGD_(cfgnode_flush_edge_count)(CFG* cfg, CfgNode* working, CfgNodeBlockCach
 void CGD_(cfgnode_flush_call_count)(CFG* cfg, CfgNode* working, CfgNodeCallCache* cache);
 void CGD_(cfg_flush_all_counts)(CFG* cfg);
 #endif
+#if ENABLE_PROFILING
+void CGD_(cfg_scale_counts)(CFG* cfg);
+#endif
+#if !ENABLE_PROFILING
+void CGD_(cfg_entered)(CFG* cfg);
+Bool CGD_(cfg_has_instr)(CFG* cfg, Addr addr);
+Bool CGD_(cfg_instr_is_frozen)(Addr addr);
+#endif
 
 /* from clo.c */
 void CGD_(set_clo_defaults)(void);
@@ -606,6 +1063,9 @@ Bool CGD_(get_debug_info)(Addr, const HChar **dirname,
                           const HChar **fn_name, UInt*, DebugInfo**);
 void CGD_(collectBlockInfo)(IRSB* bbIn, UInt*, UInt*, Bool*, UInt *);
 void CGD_(fini)(Int exitcode);
+#if !ENABLE_PROFILING
+void CGD_(discard_frozen_translations)(Addr addr, SizeT size);
+#endif
 
 /* from smarthash.c */
 SmartHash* CGD_(new_smart_hash)(Int size);
@@ -678,6 +1138,7 @@ void CGD_(copy_current_call_stack)(call_stack* dst);
 void CGD_(set_current_call_stack)(call_stack* s);
 call_entry* CGD_(get_call_entry)(Int n);
 void CGD_(push_call_stack)(BB* from, UInt jmp, BB* to, Addr sp);
+void CGD_(push_unrecorded_call)(CFG* called, Addr sp);
 void CGD_(pop_call_stack)(Bool halt);
 Int CGD_(unwind_call_stack)(Addr sp, Int);
 
@@ -712,6 +1173,118 @@ extern UInt* CGD_(fn_active_array);
 extern call_stack CGD_(current_call_stack);
 extern exec_state CGD_(current_state);
 extern ThreadId   CGD_(current_tid);
+#if SETUP_BB_FAST_PATH
+extern UInt CGD_(bb_generation);
+#endif
+#if ENABLE_PROFILING
+extern SampleState CGD_(sample);
+
+/* The execution state followed all the BBs since it was synchronized. */
+static __inline__ Bool sample_is_synced(void)
+ { return CGD_(clo).sample.off == 0 ||
+	(!CGD_(sample).off && CGD_(current_state).burst == CGD_(sample).burst); }
+#endif
+
+/* The exits of the current execution state can be recorded: it followed
+ * all the BBs (see --sample) and it is not in a frozen CFG, whose BBs are
+ * not tracked (see --freeze-complete). */
+static __inline__ Bool state_is_tracked(void)
+#if ENABLE_PROFILING
+ { return sample_is_synced(); }
+#else
+ { return !CGD_(current_state).cfg || !CGD_(current_state).cfg->frozen; }
+#endif
+
+/* The CFG entered by a call into a BB, resolved on the first call
+ * and kept in the BB until it is deleted. */
+static __inline__ CFG* bb_cfg(BB* bb)
+{
+	if (UNLIKELY(bb->cfg == 0))
+		bb->cfg = CGD_(get_cfg)(bb->groups[0].group_addr);
+
+	return bb->cfg;
+}
+
+/* Account for the buckets of an old table migrated by one operation of
+ * the hash maps, the work it adds (a timer is too coarse to measure it). */
+static __inline__
+void hash_map_migrated(UInt buckets) {
+	if (buckets > CGD_(stat).hash_migrate_max)
+		CGD_(stat).hash_migrate_max = buckets;
+}
+
+#if CFG_NODE_CACHE_SIZE > 0
+/*------------------------------------------------------------*/
+/*--- CFG node cache lookup                                ---*/
+/*------------------------------------------------------------*/
+
+/* Index of the first entry of the set for addr in a node cache.
+ * The address is hashed first, since the blocks of a node are
+ * often aligned and would otherwise share a few sets. */
+#define CFG_NODE_CACHE_SET(addr) \
+	((addr_hash_idx((addr), 32) & CGD_(clo).node_cache.sets_mask) * \
+		CGD_(clo).node_cache.ways)
+
+/* Move the entry at way to the front of its set. */
+#define CFG_NODE_CACHE_PROMOTE(type, set, way)                      \
+	do {                                                            \
+		type tmp = (set)[way];                                      \
+		VG_(memmove)(&((set)[1]), &((set)[0]), (way) * sizeof(type)); \
+		(set)[0] = tmp;                                             \
+	} while (0)
+
+/* The lookups return the matching entry of the node cache, now the
+ * most recently used of its set, or 0 if it is not cached. */
+static __inline__
+CfgNodeBlockCache* cfgnode_block_cache_lookup(CfgNode* node, Addr addr, UInt size) {
+	Int i;
+	CfgNodeBlockCache* set;
+
+	if (!node->cache.block) {
+		CGD_HOT_STAT(CGD_(stat).block_cache.misses);
+		return 0;
+	}
+
+	set = &(node->cache.block[CFG_NODE_CACHE_SET(addr)]);
+	for (i = 0; i < CGD_(clo).node_cache.ways; i++) {
+		if (set[i].addr == addr && set[i].size == size) {
+			if (i > 0)
+				CFG_NODE_CACHE_PROMOTE(CfgNodeBlockCache, set, i);
+
+			CGD_HOT_STAT(CGD_(stat).block_cache.hits);
+			return set;
+		}
+	}
+
+	CGD_HOT_STAT(CGD_(stat).block_cache.misses);
+	return 0;
+}
+
+static __inline__
+CfgNodeCallCache* cfgnode_call_cache_lookup(CfgNode* node, CFG* called, Bool indirect) {
+	Int i;
+	CfgNodeCallCache* set;
+
+	if (!node->cache.call) {
+		CGD_HOT_STAT(CGD_(stat).call_cache.misses);
+		return 0;
+	}
+
+	set = &(node->cache.call[CFG_NODE_CACHE_SET(called->addr)]);
+	for (i = 0; i < CGD_(clo).node_cache.ways; i++) {
+		if (set[i].called == called && set[i].indirect == indirect) {
+			if (i > 0)
+				CFG_NODE_CACHE_PROMOTE(CfgNodeCallCache, set, i);
+
+			CGD_HOT_STAT(CGD_(stat).call_cache.hits);
+			return set;
+		}
+	}
+
+	CGD_HOT_STAT(CGD_(stat).call_cache.misses);
+	return 0;
+}
+#endif
 
 /*------------------------------------------------------------*/
 /*--- Debug output                                         ---*/
@@ -773,4 +1346,17 @@ HChar* CGD_(strdup)(const HChar* cc, const HChar* s, const HChar* f);
 		CGD_FREE(p); 			\
 	} while (0)
 
+/* Fixed size objects, taken from a pool with POOL_ALLOC. */
+#if POOL_ALLOC
+#define CGD_POOL_MALLOC(pool,_cc,x)	VG_(allocEltPA)(pool)
+#define CGD_POOL_FREE(pool,p,x)		\
+	do { 						\
+		VG_(memset)(p, 0x41, x);	\
+		VG_(freeEltPA)(pool, p); 	\
+	} while (0)
+#else
+#define CGD_POOL_MALLOC(pool,_cc,x)	CGD_MALLOC(_cc,x)
+#define CGD_POOL_FREE(pool,p,x)		CGD_DATA_FREE(p,x)
+#endif
+
 #endif /* CGD_GLOBAL */
@@ -27,15 +27,38 @@
 
 #include "global.h"
 
-#define DEFAULT_POOL_SIZE 262144 // 256k instructions
+/* The instructions are kept in a two level map by address, like the
+ * shadow memory of Valgrind: a directory of the code pages in use and,
+ * for each page, the instructions by their offset in the page. The pages
+ * are allocated when their first instruction is seen, so only the code
+ * of the loaded objects that is actually executed takes space.
+ *
+ * The pages are small and their offsets only hold 16-bit slots into the
+ * instructions of the page, so a sparsely executed page costs little. */
+#define INSTRS_PAGE_BITS 8 // 256 bytes of code per page
+#define INSTRS_PAGE_SIZE (1 << INSTRS_PAGE_BITS)
+#define INSTRS_PAGE_MASK (INSTRS_PAGE_SIZE - 1)
+
+typedef struct _InstrsPage InstrsPage;
+struct _InstrsPage {
+	Addr page;		// addr >> INSTRS_PAGE_BITS
+	UniqueInstr** instrs;	// the instructions of the page, as they are seen
+	Int count;
+	Int capacity;
+	UShort slots[INSTRS_PAGE_SIZE];	// 1 + position in instrs, 0 if none
+};
+
+HASH_MAP_TYPE(instrs_dir, Addr, InstrsPage)
+HASH_MAP_FUNCS(instrs_dir, Addr, InstrsPage, addr_hash_idx, ADDR_EQ,
+		"cgd.instrs.iip.1", CGD_(stat).instrs_pool_resizes)
 
-typedef struct _instrs_hash instrs_hash;
-struct _instrs_hash {
-	UInt size, entries;
-	UniqueInstr** table;
+typedef struct _instrs_map instrs_map;
+struct _instrs_map {
+	instrs_dir pages;		// directory of the pages, by page
+	InstrsPage* last;		// page of the last lookup
 };
 
-instrs_hash pool;
+instrs_map pool;
 
 static
 void delete_instr(UniqueInstr* instr) {
@@ -120,108 +143,119 @@ void read_instr_names(void) {
 }
 
 static __inline__
-UInt instrs_hash_idx(Addr addr, UInt size) {
-	return addr % size;
-}
+InstrsPage* lookup_page(Addr page) {
+	InstrsPage* p;
 
-static
-void resize_instrs_pool(void) {
-    Int i, new_size, conflicts1 = 0;
-    UniqueInstr **new_table, *curr, *next;
-    UInt new_idx;
-
-	// increase table by 50%.
-    new_size  = (Int) (1.5f * pool.size);
-    new_table = (UniqueInstr**) CGD_MALLOC("cgd.instrs.rit.1",
-                                  (new_size * sizeof(UniqueInstr*)));
-    VG_(memset)(new_table, 0, (new_size * sizeof(UniqueInstr*)));
-
-    for (i = 0; i < pool.size; i++) {
-		if (pool.table[i] == 0)
-			continue;
+	// Consecutive lookups are mostly in the same code page.
+	if (LIKELY(pool.last != 0 && pool.last->page == page))
+		return pool.last;
 
-		curr = pool.table[i];
-		while (curr != 0) {
-			next = curr->chain;
+	p = instrs_dir_get(&(pool.pages), page);
+	if (p)
+		pool.last = p;
 
-			new_idx = instrs_hash_idx(curr->addr, new_size);
+	return p;
+}
 
-			curr->chain = new_table[new_idx];
-			new_table[new_idx] = curr;
-			if (curr->chain)
-				conflicts1++;
+static
+InstrsPage* new_page(Addr page) {
+	InstrsPage* p;
 
-			curr = next;
-		}
-    }
+	p = (InstrsPage*) CGD_MALLOC("cgd.instrs.np.1", sizeof(InstrsPage));
+	VG_(memset)(p, 0, sizeof(InstrsPage));
+	p->page = page;
+	p->capacity = 4;
+	p->instrs = (UniqueInstr**) CGD_MALLOC("cgd.instrs.np.2",
+				(p->capacity * sizeof(UniqueInstr*)));
 
-    CGD_FREE(pool.table);
+	instrs_dir_put(&(pool.pages), page, p);
+	pool.last = p;
 
-    CGD_DEBUG(0, "Resize instructions pool: %u => %d (entries %u, conflicts %d)\n",
-	     pool.size, new_size,
-	     pool.entries, conflicts1);
+	CGD_(stat).instrs_pages++;
 
-    pool.size  = new_size;
-    pool.table = new_table;
-    CGD_(stat).instrs_pool_resizes++;
+	return p;
+}
+
+static __inline__
+UniqueInstr* page_instr(InstrsPage* p, Addr addr) {
+	UShort slot = p->slots[addr & INSTRS_PAGE_MASK];
+	return slot ? p->instrs[slot - 1] : 0;
 }
 
 static
-UniqueInstr* lookup_instr(Addr addr) {
+UniqueInstr* page_add_instr(InstrsPage* p, Addr addr, Int size) {
 	UniqueInstr* instr;
-	UInt idx;
-
-	CGD_ASSERT(addr != 0);
 
-	idx = instrs_hash_idx(addr, pool.size);
-	instr = pool.table[idx];
+	if (p->count == p->capacity) {
+		p->capacity *= 2;
+		p->instrs = (UniqueInstr**) CGD_REALLOC("cgd.instrs.pai.1", p->instrs,
+					(p->capacity * sizeof(UniqueInstr*)));
+	}
 
-	while (instr) {
-		if (instr->addr == addr)
-			break;
+	instr = (UniqueInstr*) CGD_MALLOC("cgd.instrs.gi.1", sizeof(UniqueInstr));
+	VG_(memset)(instr, 0, sizeof(UniqueInstr));
+	instr->addr = addr;
+	instr->size = size;
 
-		instr = instr->chain;
-	}
+	// At most one instruction per byte of the page.
+	CGD_ASSERT(p->count < INSTRS_PAGE_SIZE);
+	p->instrs[p->count++] = instr;
+	p->slots[addr & INSTRS_PAGE_MASK] = p->count;
 
 	return instr;
 }
 
-void CGD_(init_instrs_pool)() {
-	Int size;
+static __inline__
+UniqueInstr* lookup_instr(Addr addr) {
+	InstrsPage* p;
 
-	pool.size = DEFAULT_POOL_SIZE;
-	pool.entries = 0;
+	CGD_ASSERT(addr != 0);
 
-	size = pool.size * sizeof(UniqueInstr*);
-	pool.table = (UniqueInstr**) CGD_MALLOC("cgd.instrs.iip.1", size);
-	VG_(memset)(pool.table, 0, size);
+	p = lookup_page(addr >> INSTRS_PAGE_BITS);
+	return p ? page_instr(p, addr) : 0;
+}
+
+void CGD_(init_instrs_pool)() {
+	instrs_dir_init(&(pool.pages), 12);
+	pool.last = 0;
 
 	// read instruction names.
 	read_instr_names();
 }
 
 void CGD_(destroy_instrs_pool)() {
-	Int i;
+	UInt i;
+	Int j;
 
-	for (i = 0; i < pool.size; i++) {
-		UniqueInstr* instr = pool.table[i];
-		while (instr) {
-			UniqueInstr* next = instr->chain;
-			delete_instr(instr);
-			instr = next;
+	instrs_dir_finish(&(pool.pages));
+	for (i = 0; i < pool.pages.size; i++) {
+		InstrsPage* p = instrs_dir_at(&(pool.pages), i);
+		if (!p)
+			continue;
 
-			pool.entries--;
-		}
-	}
+		for (j = 0; j < p->count; j++)
+			delete_instr(p->instrs[j]);
 
-	CGD_ASSERT(pool.entries == 0);
+		CGD_DATA_FREE(p->instrs, (p->capacity * sizeof(UniqueInstr*)));
+		CGD_DATA_FREE(p, sizeof(InstrsPage));
+		pool.pages.entries--;
+	}
 
-	CGD_FREE(pool.table);
-	pool.table = 0;
+	instrs_dir_destroy(&(pool.pages));
+	pool.last = 0;
 }
 
 UniqueInstr* CGD_(get_instr)(Addr addr, Int size) {
-	UniqueInstr* instr = lookup_instr(addr);
+	InstrsPage* p;
+	UniqueInstr* instr;
+
+	CGD_ASSERT(addr != 0);
+
+	p = lookup_page(addr >> INSTRS_PAGE_BITS);
+	if (!p)
+		p = new_page(addr >> INSTRS_PAGE_BITS);
+
+	instr = page_instr(p, addr);
 	if (instr) {
 		CGD_ASSERT(instr->addr == addr);
 		if (size != 0) {
@@ -232,23 +266,8 @@ UniqueInstr* CGD_(get_instr)(Addr addr, Int size) {
 			}
 		}
 	} else {
-		UInt idx;
-
-		/* check fill degree of instructions pool and resize if needed (>80%) */
-		pool.entries++;
-		if (10 * pool.entries / pool.size > 8)
-			resize_instrs_pool();
-
 		// Create the instruction.
-		instr = (UniqueInstr*) CGD_MALLOC("cgd.instrs.gi.1", sizeof(UniqueInstr));
-		VG_(memset)(instr, 0, sizeof(UniqueInstr));
-		instr->addr = addr;
-		instr->size = size;
-
-		/* insert into instructions pool */
-		idx = instrs_hash_idx(addr, pool.size);
-		instr->chain = pool.table[idx];
-		pool.table[idx] = instr;
+		instr = page_add_instr(p, addr, size);
 	}
 
 	return instr;
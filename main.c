@@ -45,6 +45,11 @@ Statistics CGD_(stat);
 /* thread and signal handler specific */
 exec_state CGD_(current_state);
 
+#if ENABLE_PROFILING
+/* for all threads */
+SampleState CGD_(sample);
+#endif
+
 /*------------------------------------------------------------*/
 /*--- Statistics                                           ---*/
 /*------------------------------------------------------------*/
@@ -67,11 +72,44 @@ static void CGD_(init_statistics)(Statistics* s) {
 	s->call_stack_resizes = 0;
 	s->cfg_hash_resizes = 0;
 	s->instrs_pool_resizes = 0;
+	s->instr_refs_resizes = 0;
+	s->instrs_pages = 0;
+	s->hash_migrate_max = 0;
 
 	s->full_debug_BBs = 0;
 	s->file_line_debug_BBs = 0;
 	s->fn_name_debug_BBs = 0;
 	s->no_debug_BBs = 0;
+
+	s->phantom_records = 0;
+#if SUCC_INDEX_THRESHOLD > 0
+	s->succ_indexes = 0;
+#endif
+#if CALLS_INDEX_THRESHOLD > 0
+	s->calls_indexes = 0;
+#endif
+
+#if CFG_NODE_CACHE_SIZE > 0
+	VG_(memset)(&(s->block_cache), 0, sizeof(CacheStatistics));
+	VG_(memset)(&(s->call_cache), 0, sizeof(CacheStatistics));
+	VG_(memset)(&(s->exit_cache), 0, sizeof(CacheStatistics));
+#if EXIT_TRANSITIONS > 0
+	VG_(memset)(&(s->exit_trans), 0, sizeof(CacheStatistics));
+#endif
+#if ENABLE_PROFILING
+	s->edge_count_flushes = 0;
+	s->edge_count_walks = 0;
+#endif
+#endif
+#if SETUP_BB_FAST_PATH && ENABLE_PROFILING
+	s->fast_path_hits = 0;
+#endif
+#if ENABLE_PROFILING
+	s->sample_resyncs = 0;
+	s->sample_misses = 0;
+#else
+	s->frozen_cfgs = 0;
+#endif
 }
 
 /* A struct which holds all the running state during instrumentation.
@@ -92,6 +130,11 @@ typedef struct {
 	// current offset of guest instructions from BB start
 	UInt instr_offset;
 
+#if INLINE_EXIT_COUNTS
+	/* The exits are only counted if set (always if IRTemp_INVALID). */
+	IRTemp counting;
+#endif
+
 	/* The output SB being constructed. */
 	IRSB* sbOut;
 } CDG_State;
@@ -267,14 +310,450 @@ void addConstMemStoreStmt(IRSB* bbOut, UWord addr, UInt val, IRType hWordTy) {
  *   attached
  */
 static
-void addBBSetupCall(CDG_State* cdgs) {
+IRTemp addLoadStmt(IRSB* bbOut, IRType ty, void* addr) {
+	IRTemp tmp = newIRTemp(bbOut->tyenv, ty);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(tmp,
+					IRExpr_Load(CGD_Endness, ty, mkIRExpr_HWord((HWord) addr))));
+	return tmp;
+}
+
+static
+IRTemp addUnopStmt(IRSB* bbOut, IRType ty, IROp op, IRTemp arg) {
+	IRTemp tmp = newIRTemp(bbOut->tyenv, ty);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(tmp, IRExpr_Unop(op, IRExpr_RdTmp(arg))));
+	return tmp;
+}
+
+static
+IRTemp addBinopStmt(IRSB* bbOut, IRType ty, IROp op, IRTemp arg1, IRTemp arg2) {
+	IRTemp tmp = newIRTemp(bbOut->tyenv, ty);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(tmp,
+					IRExpr_Binop(op, IRExpr_RdTmp(arg1), IRExpr_RdTmp(arg2))));
+	return tmp;
+}
+
+#if SETUP_BB_FAST_PATH || INLINE_EXIT_COUNTS
+static
+void addCondIncrStmt(IRSB* bbOut, ULong* addr, IRTemp cond) {
+	IRTemp incr, count;
+
+	incr = addUnopStmt(bbOut, Ity_I64, Iop_32Uto64,
+			addUnopStmt(bbOut, Ity_I32, Iop_1Uto32, cond));
+	count = addBinopStmt(bbOut, Ity_I64, Iop_Add64,
+			addLoadStmt(bbOut, Ity_I64, addr), incr);
+	addStmtToIRSB(bbOut,
+			IRStmt_Store(CGD_Endness, mkIRExpr_HWord((HWord) addr),
+					IRExpr_RdTmp(count)));
+}
+#endif
+
+#if ENABLE_PROFILING
+/* Decrement the BBs left in the sampling period (see SampleState).
+ * Returns a temporary with the updated value. */
+static
+IRTemp addSampleStmts(IRSB* bbOut) {
+	IRTemp left = newIRTemp(bbOut->tyenv, Ity_I64);
+
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(left,
+					IRExpr_Binop(Iop_Sub64,
+							IRExpr_RdTmp(addLoadStmt(bbOut, Ity_I64, &(CGD_(sample).left))),
+							IRExpr_Const(IRConst_U64(1)))));
+	addStmtToIRSB(bbOut,
+			IRStmt_Store(CGD_Endness, mkIRExpr_HWord((HWord) &(CGD_(sample).left)),
+					IRExpr_RdTmp(left)));
+	return left;
+}
+
+/* Check that offset <= left < offset + bound, that is, the position
+ * of the BB from the end of the burst. */
+static
+IRTemp addBelowStmt(IRSB* bbOut, IRTemp left, ULong offset, ULong bound) {
+	IRTemp tmp = newIRTemp(bbOut->tyenv, Ity_I64);
+	IRTemp below = newIRTemp(bbOut->tyenv, Ity_I1);
+
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(tmp,
+					IRExpr_Binop(Iop_Sub64, IRExpr_RdTmp(left),
+							IRExpr_Const(IRConst_U64(offset)))));
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(below,
+					IRExpr_Binop(Iop_CmpLT64U, IRExpr_RdTmp(tmp),
+							IRExpr_Const(IRConst_U64(bound)))));
+	return below;
+}
+#endif
+
+#if ENABLE_PROFILING && (SETUP_BB_FAST_PATH || INLINE_EXIT_COUNTS)
+static
+IRTemp addAndStmt(IRSB* bbOut, IRTemp cond1, IRTemp cond2) {
+	IRTemp tmp, res;
+
+	tmp = addBinopStmt(bbOut, Ity_I32, Iop_And32,
+			addUnopStmt(bbOut, Ity_I32, Iop_1Uto32, cond1),
+			addUnopStmt(bbOut, Ity_I32, Iop_1Uto32, cond2));
+	res = newIRTemp(bbOut->tyenv, Ity_I1);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(res, IRExpr_Binop(Iop_CmpNE32, IRExpr_RdTmp(tmp),
+					IRExpr_Const(IRConst_U32(0)))));
+	return res;
+}
+#endif
+
+#if INLINE_EXIT_COUNTS
+static
+void addIncrStmt(IRSB* bbOut, ULong* addr) {
+	IRTemp count = newIRTemp(bbOut->tyenv, Ity_I64);
+
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(count,
+					IRExpr_Binop(Iop_Add64,
+							IRExpr_RdTmp(addLoadStmt(bbOut, Ity_I64, addr)),
+							IRExpr_Const(IRConst_U64(1)))));
+	addStmtToIRSB(bbOut,
+			IRStmt_Store(CGD_Endness, mkIRExpr_HWord((HWord) addr),
+					IRExpr_RdTmp(count)));
+}
+#endif
+
+#if INLINE_EXIT_COUNTS
+/* Store the exit val in jmps_passed, marked as counted if counted is
+ * set (always if it is IRTemp_INVALID). */
+static
+void addJmpsPassedStmt(IRSB* bbOut, UInt val, IRTemp counted) {
+	IRExpr* data;
+
+	if (counted == IRTemp_INVALID)
+		data = IRExpr_Const(IRConst_U32(val | JMPS_PASSED_COUNTED));
+	else
+		data = IRExpr_ITE(IRExpr_RdTmp(counted),
+				IRExpr_Const(IRConst_U32(val | JMPS_PASSED_COUNTED)),
+				IRExpr_Const(IRConst_U32(val)));
+
+	addStmtToIRSB(bbOut,
+			IRStmt_Store(CGD_Endness,
+					mkIRExpr_HWord((HWord) &CGD_(current_state).jmps_passed), data));
+}
+#endif
+
+#if SETUP_BB_FAST_PATH
+static
+void addCondStoreStmt(IRSB* bbOut, IRType ty, void* addr, IRTemp cond,
+		IRExpr* iftrue, IRTemp iffalse) {
+	IRTemp tmp = newIRTemp(bbOut->tyenv, ty);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(tmp,
+					IRExpr_ITE(IRExpr_RdTmp(cond), iftrue, IRExpr_RdTmp(iffalse))));
+	addStmtToIRSB(bbOut,
+			IRStmt_Store(CGD_Endness, mkIRExpr_HWord((HWord) addr),
+					IRExpr_RdTmp(tmp)));
+}
+
+/* Address of a field of a structure given by a temporary. */
+static
+IRTemp addFieldAddrStmt(IRSB* bbOut, IRTemp base, HWord offset, IRType hWordTy) {
+	IRTemp addr = newIRTemp(bbOut->tyenv, hWordTy);
+
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(addr,
+					IRExpr_Binop(hWordTy == Ity_I64 ? Iop_Add64 : Iop_Add32,
+							IRExpr_RdTmp(base), mkIRExpr_HWord(offset))));
+	return addr;
+}
+
+/* Load a field of a structure given by a temporary. */
+static
+IRTemp addLoadFieldStmt(IRSB* bbOut, IRType ty, IRTemp base, HWord offset,
+		IRType hWordTy) {
+	IRTemp addr = addFieldAddrStmt(bbOut, base, offset, hWordTy);
+	IRTemp tmp = newIRTemp(bbOut->tyenv, ty);
+
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(tmp, IRExpr_Load(CGD_Endness, ty, IRExpr_RdTmp(addr))));
+	return tmp;
+}
+
+#if ENABLE_PROFILING && !INLINE_EXIT_COUNTS
+/* Increment a counter field of a structure given by a temporary
+ * if cond is set. */
+static
+void addCondIncrFieldStmt(IRSB* bbOut, IRTemp base, HWord offset, IRTemp cond,
+		IRType hWordTy) {
+	IRTemp addr = addFieldAddrStmt(bbOut, base, offset, hWordTy);
+	IRTemp count = newIRTemp(bbOut->tyenv, Ity_I64);
+	IRTemp incr;
+
+	incr = addUnopStmt(bbOut, Ity_I64, Iop_32Uto64,
+			addUnopStmt(bbOut, Ity_I32, Iop_1Uto32, cond));
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(count,
+					IRExpr_Binop(Iop_Add64,
+							IRExpr_Load(CGD_Endness, Ity_I64, IRExpr_RdTmp(addr)),
+							IRExpr_RdTmp(incr))));
+	addStmtToIRSB(bbOut,
+			IRStmt_Store(CGD_Endness, IRExpr_RdTmp(addr), IRExpr_RdTmp(count)));
+}
+#endif
+
+/* Inline version of setup_bb for the expected transition into this BB
+ * (see BBFastPath). It checks that the previous BB, the exit taken and
+ * the working node are the expected ones, that no BB was deleted since
+ * and that no stack frame must be unwound. In that case, the execution
+ * state is updated directly. Returns a temporary that is set if the
+ * setup_bb helper must be called instead. It is also set if enabled
+ * is given and not set.
+ */
+static
+IRTemp addFastSetupStmts(CDG_State* cdgs, const VexGuestLayout* layout, IRType hWordTy,
+		IRTemp enabled) {
+	IRSB* bbOut = cdgs->sbOut;
+	BB* bb = cdgs->bb;
+	Bool is64 = (hWordTy == Ity_I64);
+	IROp opXOR = is64 ? Iop_Xor64 : Iop_Xor32;
+	IROp opOR = is64 ? Iop_Or64 : Iop_Or32;
+	IROp widen = is64 ? Iop_1Uto64 : Iop_1Uto32;
+	IRTemp diff, tmp, sp, last_bb, working, passed, gen, jmp, next, hit, miss;
+	IRExpr* zero = is64 ? IRExpr_Const(IRConst_U64(0)) :
+			IRExpr_Const(IRConst_U32(0));
+
+	CGD_ASSERT(layout->sizeof_SP == (is64 ? 8 : 4));
+
+	// Previous BB.
+	last_bb = addLoadStmt(bbOut, hWordTy, &(CGD_(current_state).bb));
+	diff = addBinopStmt(bbOut, hWordTy, opXOR, last_bb,
+			addLoadStmt(bbOut, hWordTy, &(bb->fast.last_bb)));
+
+	// Exit taken.
+	passed = addLoadStmt(bbOut, Ity_I32, &(CGD_(current_state).jmps_passed));
+	tmp = addBinopStmt(bbOut, Ity_I32, Iop_Xor32, passed,
+			addLoadStmt(bbOut, Ity_I32, &(bb->fast.passed)));
+	if (is64)
+		tmp = addUnopStmt(bbOut, Ity_I64, Iop_32Uto64, tmp);
+	diff = addBinopStmt(bbOut, hWordTy, opOR, diff, tmp);
+
+	// No BB deleted since it was set (last_bb may be a new one).
+	tmp = addBinopStmt(bbOut, Ity_I32, Iop_Xor32,
+			addLoadStmt(bbOut, Ity_I32, &(CGD_(bb_generation))),
+			addLoadStmt(bbOut, Ity_I32, &(bb->fast.gen)));
+	gen = newIRTemp(bbOut->tyenv, Ity_I1);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(gen, IRExpr_Binop(Iop_CmpEQ32, IRExpr_RdTmp(tmp),
+					IRExpr_Const(IRConst_U32(0)))));
+	if (is64)
+		tmp = addUnopStmt(bbOut, Ity_I64, Iop_32Uto64, tmp);
+	diff = addBinopStmt(bbOut, hWordTy, opOR, diff, tmp);
+
+	// The most recent transition of the exit must leave the working node
+	// into this BB. The exit of a deleted BB is not read, but an exit of
+	// this one instead.
+	jmp = newIRTemp(bbOut->tyenv, hWordTy);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(jmp, IRExpr_ITE(IRExpr_RdTmp(gen),
+					IRExpr_RdTmp(addLoadStmt(bbOut, hWordTy, &(bb->fast.jmp))),
+					mkIRExpr_HWord((HWord) &(bb->jmp[0])))));
+	working = addLoadStmt(bbOut, hWordTy, &(CGD_(current_state).working));
+	tmp = addBinopStmt(bbOut, hWordTy, opXOR, working,
+			addLoadFieldStmt(bbOut, hWordTy, jmp,
+					offsetof(CJmpInfo, trans[0].src), hWordTy));
+	diff = addBinopStmt(bbOut, hWordTy, opOR, diff, tmp);
+	next = addLoadFieldStmt(bbOut, hWordTy, jmp,
+			offsetof(CJmpInfo, trans[0].next), hWordTy);
+	tmp = newIRTemp(bbOut->tyenv, hWordTy);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(tmp, IRExpr_Binop(opXOR, IRExpr_RdTmp(next),
+					mkIRExpr_HWord((HWord) bb))));
+	diff = addBinopStmt(bbOut, hWordTy, opOR, diff, tmp);
+
+	// Unwinding needed (see CGD_(unwind_call_stack)).
+	sp = newIRTemp(bbOut->tyenv, hWordTy);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(sp, IRExpr_Get(layout->offset_SP, hWordTy)));
+	tmp = addBinopStmt(bbOut, Ity_I1, is64 ? Iop_CmpLT64U : Iop_CmpLT32U,
+			addLoadStmt(bbOut, hWordTy, &(CGD_(current_call_stack).top_sp)), sp);
+	tmp = addUnopStmt(bbOut, hWordTy, widen, tmp);
+	diff = addBinopStmt(bbOut, hWordTy, opOR, diff, tmp);
+
+	// Disabled for this execution.
+	if (enabled != IRTemp_INVALID) {
+		IRTemp on = addUnopStmt(bbOut, hWordTy, widen, enabled);
+		tmp = newIRTemp(bbOut->tyenv, hWordTy);
+		addStmtToIRSB(bbOut,
+				IRStmt_WrTmp(tmp, IRExpr_Binop(opXOR, IRExpr_RdTmp(on),
+						is64 ? IRExpr_Const(IRConst_U64(1)) : IRExpr_Const(IRConst_U32(1)))));
+		diff = addBinopStmt(bbOut, hWordTy, opOR, diff, tmp);
+	}
+
+	hit = newIRTemp(bbOut->tyenv, Ity_I1);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(hit, IRExpr_Binop(is64 ? Iop_CmpEQ64 : Iop_CmpEQ32,
+					IRExpr_RdTmp(diff), zero)));
+	miss = newIRTemp(bbOut->tyenv, Ity_I1);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(miss, IRExpr_Binop(is64 ? Iop_CmpNE64 : Iop_CmpNE32,
+					IRExpr_RdTmp(diff), zero)));
+
+	// Update the execution state (unchanged on a miss).
+	addCondStoreStmt(bbOut, hWordTy, &(CGD_(current_state).working), hit,
+			IRExpr_RdTmp(addLoadFieldStmt(bbOut, hWordTy, jmp,
+					offsetof(CJmpInfo, trans[0].dst), hWordTy)), working);
+	addCondStoreStmt(bbOut, hWordTy, &(CGD_(current_state).bb), hit,
+			mkIRExpr_HWord((HWord) bb), last_bb);
+	addCondStoreStmt(bbOut, Ity_I32, &(CGD_(current_state).jmps_passed), hit,
+			IRExpr_Const(IRConst_U32(0)), passed);
+	addCondStoreStmt(bbOut, Ity_I32, &(bb->fast.misses), hit,
+			IRExpr_Const(IRConst_U32(0)),
+			addLoadStmt(bbOut, Ity_I32, &(bb->fast.misses)));
+
+#if ENABLE_PROFILING
+#if !INLINE_EXIT_COUNTS
+	addCondIncrFieldStmt(bbOut, jmp, offsetof(CJmpInfo, trans[0].count), hit,
+			hWordTy);
+#endif
+	// Otherwise already counted in the exit, just account for the hit.
+	if (VG_(clo_stats))
+		addCondIncrStmt(bbOut, &(CGD_(stat).fast_path_hits), hit);
+#endif
+	addCondIncrStmt(bbOut, &(CGD_(stat).bb_executions), hit);
+
+	return miss;
+}
+#endif
+
+#if !ENABLE_PROFILING
+/* A block of a frozen CFG may also be part of CFGs that are not frozen.
+ * Returns a temporary that is set if the current execution state is
+ * tracked (see state_is_tracked), so setup_bb must still be called. */
+static
+IRTemp addTrackedStmts(IRSB* bbOut, IRType hWordTy) {
+	static Bool no_frozen = False;
+	Bool is64 = (hWordTy == Ity_I64);
+	IRTemp cfg, none, addr, frozen, tracked;
+
+	cfg = addLoadStmt(bbOut, hWordTy, &(CGD_(current_state).cfg));
+	none = newIRTemp(bbOut->tyenv, Ity_I1);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(none, IRExpr_Binop(is64 ? Iop_CmpEQ64 : Iop_CmpEQ32,
+					IRExpr_RdTmp(cfg), mkIRExpr_HWord(0))));
+
+	// Without a CFG, the flag is read from no_frozen instead.
+	addr = newIRTemp(bbOut->tyenv, hWordTy);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(addr, IRExpr_ITE(IRExpr_RdTmp(none),
+					mkIRExpr_HWord((HWord) &no_frozen),
+					IRExpr_Binop(is64 ? Iop_Add64 : Iop_Add32, IRExpr_RdTmp(cfg),
+							mkIRExpr_HWord(offsetof(CFG, frozen))))));
+
+	frozen = newIRTemp(bbOut->tyenv, Ity_I8);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(frozen, IRExpr_Load(CGD_Endness, Ity_I8, IRExpr_RdTmp(addr))));
+	tracked = newIRTemp(bbOut->tyenv, Ity_I1);
+	addStmtToIRSB(bbOut,
+			IRStmt_WrTmp(tracked, IRExpr_Binop(Iop_CmpEQ32,
+					IRExpr_RdTmp(addUnopStmt(bbOut, Ity_I32, Iop_8Uto32, frozen)),
+					IRExpr_Const(IRConst_U32(0)))));
+	return tracked;
+}
+#endif
+
+/* add helper call to setup_bb, with pointer to BB struct as argument
+ *
+ * precondition for setup_bb:
+ * - jmps_passed has number of cond.jumps passed in last executed BB
+ * - current_bbcc has a pointer to the BBCC of the last executed BB
+ *   Thus, if bbcc_jmpkind is != -1 (JmpNone),
+ *     current_bbcc->bb->jmp_addr
+ *   gives the address of the jump source.
+ *
+ * the setup does 2 things:
+ * - trace call:
+ *   * Unwind own call stack, i.e sync our ESP with real ESP
+ *     This is for ESP manipulation (longjmps, C++ exec handling) and RET
+ *   * For CALLs or JMPs crossing objects, record call arg +
+ *     push are on own call stack
+ *
+ * - prepare for cache log functions:
+ *   set current_bbcc to BBCC that gets the costs for this BB execution
+ *   attached
+ *
+ * With SETUP_BB_FAST_PATH, the call is guarded by an inline check for
+ * the expected transition into the BB (see addFastSetupStmts).
+ */
+static
+void addBBSetupCall(CDG_State* cdgs, const VexGuestLayout* layout, IRType hWordTy,
+		Bool frozen) {
 	IRDirty* di;
 	IRExpr *arg1, **argv;
+	IRTemp guard = IRTemp_INVALID;
+#if SETUP_BB_FAST_PATH
+	Bool fast = True;
+	IRTemp fast_enabled = IRTemp_INVALID;
+#endif
+
+#if INLINE_EXIT_COUNTS
+	cdgs->counting = IRTemp_INVALID;
+#endif
+#if ENABLE_PROFILING
+	/* While sampling, only the BBs of a burst call setup_bb. Its first and
+	 * last BBs always do (to start and end the burst), and the exits are
+	 * only counted if they lead to another BB of the burst. */
+	if (CGD_(clo).sample.off > 0) {
+		ULong on = CGD_(clo).sample.on;
+		IRTemp left = addSampleStmts(cdgs->sbOut);
+
+		guard = addBelowStmt(cdgs->sbOut, left, 0, on);
+#if SETUP_BB_FAST_PATH
+		fast = (on > 2);
+		if (fast)
+			fast_enabled = addBelowStmt(cdgs->sbOut, left, 1, on - 2);
+#endif
+#if INLINE_EXIT_COUNTS
+		cdgs->counting = addBelowStmt(cdgs->sbOut, left, 1, on - 1);
+#endif
+	}
+#endif
 
 	arg1 = mkIRExpr_HWord((HWord) cdgs->bb);
 	argv = mkIRExprVec_1(arg1);
 	di = unsafeIRDirty_0_N(1, "setup_bb",
 			VG_(fnptr_to_fnentry)(&CGD_(setup_bb)), argv);
+
+#if !ENABLE_PROFILING
+	// Only called from the blocks of a frozen CFG if they are
+	// executed as part of another CFG.
+	if (frozen) {
+		guard = addTrackedStmts(cdgs->sbOut, hWordTy);
+#if SETUP_BB_FAST_PATH
+		fast = False;
+#endif
+	}
+#else
+	CGD_UNUSED(frozen);
+#endif
+
+#if SETUP_BB_FAST_PATH
+#if CGD_ENABLE_DEBUG
+	// Keep the debug output of every BB.
+	fast = fast && (CGD_(clo).verbose == 0);
+#endif
+	if (fast) {
+		IRTemp miss = addFastSetupStmts(cdgs, layout, hWordTy, fast_enabled);
+#if ENABLE_PROFILING
+		if (guard != IRTemp_INVALID)
+			miss = addAndStmt(cdgs->sbOut, guard, miss);
+#endif
+		guard = miss;
+	}
+#else
+	CGD_UNUSED(layout);
+	CGD_UNUSED(hWordTy);
+#endif
+
+	if (guard != IRTemp_INVALID)
+		di->guard = IRExpr_RdTmp(guard);
+
 	addStmtToIRSB(cdgs->sbOut, IRStmt_Dirty(di));
 }
 
@@ -324,7 +803,23 @@ static IRSB* CGD_(instrument)(VgCallbackClosure* closure, IRSB* sbIn,
 	 */
 	cdgs.bb = CGD_(get_bb)(origAddr, sbIn, &(cdgs.seen_before));
 
-	addBBSetupCall(&cdgs);
+	/* The side exits and groups are already known from CGD_(collectBlockInfo),
+	 * which is enough to select how setup_bb processes the exits of this BB. */
+	if (cdgs.bb->groups_count > 1)
+		cdgs.bb->shape = bbs_Generic;
+	else if (cdgs.bb->cjmp_count > 0)
+		cdgs.bb->shape = bbs_SingleGroup;
+	else
+		cdgs.bb->shape = bbs_NoSideExits;
+
+	/* Only the entry of a frozen CFG keeps calling setup_bb; the BBs of its
+	 * body are followed from their calls and returns (see frozen_setup),
+	 * unless they are executed as part of another CFG. */
+#if !ENABLE_PROFILING
+	addBBSetupCall(&cdgs, layout, hWordTy, CGD_(cfg_instr_is_frozen)(origAddr));
+#else
+	addBBSetupCall(&cdgs, layout, hWordTy, False);
+#endif
 
 	// Set up running state
 	cdgs.ii_index = 0;
@@ -482,8 +977,20 @@ static IRSB* CGD_(instrument)(VgCallbackClosure* closure, IRSB* sbIn,
 			 * A correction is needed if VEX inverted the last jump condition
 			 */
 			UInt val = inverted ? cJumps + 1 : cJumps;
+#if INLINE_EXIT_COUNTS
+			{
+				// Also mark it as counted if the exit is taken.
+				IRTemp taken = newIRTemp(cdgs.sbOut->tyenv, Ity_I1);
+				addStmtToIRSB(cdgs.sbOut, IRStmt_WrTmp(taken, st->Ist.Exit.guard));
+				if (cdgs.counting != IRTemp_INVALID)
+					taken = addAndStmt(cdgs.sbOut, taken, cdgs.counting);
+				addJmpsPassedStmt(cdgs.sbOut, val, taken);
+				addCondIncrStmt(cdgs.sbOut, &(cdgs.bb->jmp[val].trans[0].count), taken);
+			}
+#else
 			addConstMemStoreStmt(cdgs.sbOut,
 					(UWord) &CGD_(current_state).jmps_passed, val, hWordTy);
+#endif
 			cJumps++;
 
 			// Mark the new instruction as the beginning of a new group of instructions.
@@ -529,22 +1036,40 @@ static IRSB* CGD_(instrument)(VgCallbackClosure* closure, IRSB* sbIn,
 
 	/* Update global variable jmps_passed at end of SB.
 	 * As CGD_(current_state).jmps_passed is reset to 0 in setup_bb,
-	 * this can be omitted if there is no conditional jump in this SB.
+	 * this can be omitted if there is no conditional jump in this SB
+	 * (unless the final exit must be marked as counted).
 	 * A correction is needed if VEX inverted the last jump condition
 	 */
-	if (cJumps > 0) {
+	if (cJumps > 0 || INLINE_EXIT_COUNTS) {
 		UInt jmps_passed = cJumps;
 		if (cdgs.bb->cjmp_inverted)
 			jmps_passed--;
+#if INLINE_EXIT_COUNTS
+		addJmpsPassedStmt(cdgs.sbOut, jmps_passed, cdgs.counting);
+#else
 		addConstMemStoreStmt(cdgs.sbOut,
 				(UWord) &CGD_(current_state).jmps_passed, jmps_passed, hWordTy);
+#endif
 	}
+#if INLINE_EXIT_COUNTS
+	/* Count the final exit, reached if no side exit was taken. */
+	{
+		ULong* count = &(cdgs.bb->jmp[cdgs.bb->cjmp_inverted ?
+				cJumps - 1 : cJumps].trans[0].count);
+		if (cdgs.counting != IRTemp_INVALID)
+			addCondIncrStmt(cdgs.sbOut, count, cdgs.counting);
+		else
+			addIncrStmt(cdgs.sbOut, count);
+	}
+#endif
 	CGD_ASSERT(cdgs.bb->cjmp_count == cJumps);
 	CGD_ASSERT(cdgs.bb->instr_count == cdgs.ii_index);
 	CGD_ASSERT(cdgs.bb->groups_count == cdgs.ig_index);
 
-	/* Info for final exit from BB */
-	{
+	/* Info for final exit from BB.
+	 * Like the side exits, it is only filled once: the exits also keep
+	 * run-time state (transitions) that a swap would mix up. */
+	if (!cdgs.seen_before) {
 		BBJumpKind jk;
 		Addr dst;
 		Bool indirect;
@@ -582,7 +1107,7 @@ static IRSB* CGD_(instrument)(VgCallbackClosure* closure, IRSB* sbIn,
 	}
 
 	/* swap information of last exit with final exit if inverted */
-	if (cdgs.bb->cjmp_inverted) {
+	if (!cdgs.seen_before && cdgs.bb->cjmp_inverted) {
 		CJmpInfo tmp;
 
 		tmp = cdgs.bb->jmp[cJumps];
@@ -613,6 +1138,19 @@ static IRSB* CGD_(instrument)(VgCallbackClosure* closure, IRSB* sbIn,
 /*--- Discarding BB info                                           ---*/
 /*--------------------------------------------------------------------*/
 
+#if !ENABLE_PROFILING
+static Bool discarding_frozen = False;
+
+/* Discard the translations of a block of a frozen CFG, so its BBs are
+ * instrumented again without the setup_bb call. Their BB info is kept,
+ * as the execution states may still refer to them. */
+void CGD_(discard_frozen_translations)(Addr addr, SizeT size) {
+	discarding_frozen = True;
+	VG_(discard_translations_safely)(addr, size, "cfggrind-freeze");
+	discarding_frozen = False;
+}
+#endif
+
 // Called when a translation is removed from the translation cache for
 // any reason at all: to free up space, because the guest code was
 // unmapped or modified, or for any arbitrary reason.
@@ -620,6 +1158,11 @@ static
 void cdg_discard_superblock_info(Addr orig_addr, VexGuestExtents vge) {
 	tl_assert(vge.n_used > 0);
 
+#if !ENABLE_PROFILING
+	if (discarding_frozen)
+		return;
+#endif
+
 	if (0)
 		VG_(printf)("discard_superblock_info: %p, %p, %llu\n",
 				(void*) orig_addr, (void*) vge.base[0], (ULong) vge.len[0]);
@@ -641,8 +1184,17 @@ void unwind_thread(thread_info* t) {
 	while (CGD_(current_call_stack).sp > 0)
 		CGD_(pop_call_stack)(True);
 
-	// Set the last working instructions to its exit node.
-	CGD_(cfgnode_set_halt)(CGD_(current_state).cfg, CGD_(current_state).working);
+	// Where a state that missed BBs, or is frozen, halted is unknown.
+	if (state_is_tracked()) {
+		// Set the last working instructions to its exit node.
+		CGD_(cfgnode_set_halt)(CGD_(current_state).cfg, CGD_(current_state).working);
+
+#if INLINE_EXIT_COUNTS
+		// No BB follows the last exit taken.
+		if (CGD_(current_state).bb)
+			CGD_(bb_uncount_exit)(CGD_(current_state).bb, CGD_(current_state).jmps_passed);
+#endif
+	}
 
 	/* reset context and function stack for context generation */
 	CGD_(init_exec_state)(&CGD_(current_state));
@@ -679,6 +1231,64 @@ void dump_memory_mappings(const HChar* filename) {
 }
 
 
+#if CFG_NODE_CACHE_SIZE > 0
+/* Number of CFGs reported by their node cache misses */
+#define TOP_MISSES_CFGS 10
+
+typedef struct {
+	Addr addr;
+	HChar* name;
+	ULong misses;
+} CfgMisses;
+
+static CfgMisses top_misses[TOP_MISSES_CFGS];
+static Int top_misses_count = 0;
+
+/* Keep the CFGs with most node cache misses, as the CFGs are
+ * destroyed before the statistics are printed. */
+static
+void collect_cfg_misses(CFG* cfg) {
+	Int i;
+	ULong misses;
+	FunctionDesc* fdesc;
+	HChar* name;
+
+	misses = CGD_(cfg_cache_misses)(cfg);
+	if (misses == 0)
+		return;
+
+	for (i = top_misses_count; i > 0 && top_misses[i-1].misses < misses; i--)
+		;
+	if (i >= TOP_MISSES_CFGS)
+		return;
+
+	if (top_misses_count < TOP_MISSES_CFGS)
+		top_misses_count++;
+	else
+		CGD_FREE(top_misses[TOP_MISSES_CFGS-1].name);
+
+	VG_(memmove)(&(top_misses[i+1]), &(top_misses[i]),
+			(top_misses_count - 1 - i) * sizeof(CfgMisses));
+
+	fdesc = CGD_(cfg_fdesc)(cfg);
+	name = fdesc ? CGD_(fdesc_function_name)(fdesc) : 0;
+
+	top_misses[i].addr = CGD_(cfg_addr)(cfg);
+	top_misses[i].name = CGD_STRDUP("cgd.main.ccm.1", name ? name : "unknown");
+	top_misses[i].misses = misses;
+}
+
+static
+void print_cache_stats(const HChar* name, CacheStatistics* cs) {
+	ULong lookups = cs->hits + cs->misses;
+
+	VG_(message)(Vg_DebugMsg, "%s %llu hits (%llu%%), %llu misses, "
+			"%llu evictions, %llu flushes\n", name, cs->hits,
+			lookups > 0 ? (cs->hits * 100 / lookups) : 0,
+			cs->misses, cs->evictions, cs->flushes);
+}
+#endif
+
 static
 void cdg_print_stats(void) {
 	int BB_lookups =
@@ -715,6 +1325,12 @@ void cdg_print_stats(void) {
 	CGD_(stat).bb_retranslations);
 	VG_(message)(Vg_DebugMsg, "Distinct instrs:    %d\n",
 	CGD_(stat).distinct_instrs);
+	VG_(message)(Vg_DebugMsg, "Instruction pages:  %d\n",
+	CGD_(stat).instrs_pages);
+	VG_(message)(Vg_DebugMsg, "Hash resizes:       %d (at most %u buckets migrated at once)\n",
+	CGD_(stat).bb_hash_resizes + CGD_(stat).cfg_hash_resizes +
+	CGD_(stat).instrs_pool_resizes + CGD_(stat).instr_refs_resizes,
+	CGD_(stat).hash_migrate_max);
 	VG_(message)(Vg_DebugMsg, "Distinct groups:    %d\n",
 	CGD_(stat).distinct_groups);
 	VG_(message)(Vg_DebugMsg, "Distinct CFGs:      %d\n",
@@ -723,7 +1339,75 @@ void cdg_print_stats(void) {
 	CGD_(stat).distinct_cfg_nodes);
 	VG_(message)(Vg_DebugMsg, "BBs Executed:       %llu\n",
 	CGD_(stat).bb_executions);
+	VG_(message)(Vg_DebugMsg, "Phantom records:    %llu\n",
+	CGD_(stat).phantom_records);
+#if SUCC_INDEX_THRESHOLD > 0
+	VG_(message)(Vg_DebugMsg, "Successors indexes: %d\n",
+	CGD_(stat).succ_indexes);
+#endif
+#if CALLS_INDEX_THRESHOLD > 0
+	VG_(message)(Vg_DebugMsg, "Calls indexes:      %d\n",
+	CGD_(stat).calls_indexes);
+#endif
+
+#if SETUP_BB_FAST_PATH && ENABLE_PROFILING
+	VG_(message)(Vg_DebugMsg, "Inline setup BBs:   %llu\n",
+	CGD_(stat).fast_path_hits);
+#endif
+
+#if ENABLE_PROFILING
+	if (CGD_(clo).sample.off > 0) {
+		VG_(message)(Vg_DebugMsg, "Sampling bursts:    %u (%llu on, %llu off)\n",
+		CGD_(sample).burst, CGD_(clo).sample.on, CGD_(clo).sample.off);
+		VG_(message)(Vg_DebugMsg, "Sampling resyncs:   %llu (%llu BBs missed)\n",
+		CGD_(stat).sample_resyncs, CGD_(stat).sample_misses);
+	}
+#else
+	if (CGD_(clo).freeze.complete)
+		VG_(message)(Vg_DebugMsg, "Frozen CFGs:        %d\n",
+		CGD_(stat).frozen_cfgs);
+#endif
+
+#if CFG_NODE_CACHE_SIZE > 0
+	/* Node cache stats */
+	VG_(message)(Vg_DebugMsg, "Node caches:        %d entries, %d ways\n",
+	CGD_(clo).node_cache.size, CGD_(clo).node_cache.ways);
+	print_cache_stats("Block cache:       ", &CGD_(stat).block_cache);
+	print_cache_stats("Call cache:        ", &CGD_(stat).call_cache);
+	print_cache_stats("Exit cache:        ", &CGD_(stat).exit_cache);
+#if EXIT_TRANSITIONS > 0
+	print_cache_stats("Exit transitions:  ", &CGD_(stat).exit_trans);
+#endif
+#if ENABLE_PROFILING
+	VG_(message)(Vg_DebugMsg, "Edge count flushes: %llu (avg walk %llu.%02llu)\n",
+	CGD_(stat).edge_count_flushes,
+	CGD_(stat).edge_count_flushes > 0 ?
+		CGD_(stat).edge_count_walks / CGD_(stat).edge_count_flushes : 0,
+	CGD_(stat).edge_count_flushes > 0 ?
+		(CGD_(stat).edge_count_walks * 100 / CGD_(stat).edge_count_flushes) % 100 : 0);
+#endif
+
+	if (top_misses_count > 0) {
+		Int i;
+
+		VG_(message)(Vg_DebugMsg, "Top CFGs by node cache misses:\n");
+		for (i = 0; i < top_misses_count; i++)
+			VG_(message)(Vg_DebugMsg, "  0x%lx %s: %llu\n",
+			top_misses[i].addr, top_misses[i].name, top_misses[i].misses);
+	}
+#endif
+}
+
+#if CFG_NODE_CACHE_SIZE > 0
+static
+void free_cfg_misses(void) {
+	Int i;
+
+	for (i = 0; i < top_misses_count; i++)
+		CGD_FREE(top_misses[i].name);
+	top_misses_count = 0;
 }
+#endif
 
 static
 void finish(void) {
@@ -734,14 +1418,25 @@ void finish(void) {
 	 */
 	CGD_(forall_threads)(unwind_thread);
 
+#if ENABLE_PROFILING && EXIT_TRANSITIONS > 0
+	CGD_(bb_flush_all_counts)();
+#endif
 #if ENABLE_PROFILING && CFG_NODE_CACHE_SIZE > 0
 	CGD_(forall_cfg)(CGD_(cfg_flush_all_counts));
 #endif
+#if ENABLE_PROFILING
+	// Estimate the counts of all executions from the sampled ones.
+	if (CGD_(clo).sample.off > 0)
+		CGD_(forall_cfg)(CGD_(cfg_scale_counts));
+#endif
+
+	// Create the phantom nodes of the exits recorded during execution.
+	CGD_(forall_cfg)(CGD_(cfg_materialize_phantoms));
 
 	// Fix CFG if possible.
 	CGD_(forall_cfg)(CGD_(fix_cfg));
 
-	// Always check the CFGs.
+	// Check the CFGs (--check-cfg).
 	CGD_(forall_cfg)(CGD_(check_cfg));
 
 	if (CGD_(clo).cfg_outfile) {
@@ -758,23 +1453,36 @@ void finish(void) {
 		VG_(free)(filename);
 	}
 
+	if (CGD_(clo).indirect_calls) {
+		filename = VG_(expand_file_name)("--indirect-calls",
+						CGD_(clo).indirect_calls);
+		CGD_(write_indirect_calls)(filename);
+		VG_(free)(filename);
+	}
+
 	// Dump the CFG dot files.
 	CGD_(forall_cfg)(CGD_(dump_cfg));
 
+#if CFG_NODE_CACHE_SIZE > 0
+	if (VG_(clo_stats))
+		CGD_(forall_cfg)(collect_cfg_misses);
+#endif
+
 	CGD_(destroy_threads)();
 	CGD_(destroy_instrs_pool)();
 	CGD_(destroy_cfg_hash)();
 	CGD_(destroy_bb_hash)();
 	CGD_(destroy_obj_table)();
 
-	if (VG_(clo_verbosity) == 0)
-		return;
-
-	if (VG_(clo_stats)) {
+	if (VG_(clo_verbosity) > 0 && VG_(clo_stats)) {
 		VG_(message)(Vg_DebugMsg, "\n");
 		cdg_print_stats();
 		VG_(message)(Vg_DebugMsg, "\n");
 	}
+
+#if CFG_NODE_CACHE_SIZE > 0
+	free_cfg_misses();
+#endif
 }
 
 void CGD_(fini)(Int exitcode) {
@@ -786,16 +1494,13 @@ void CGD_(fini)(Int exitcode) {
 /*--------------------------------------------------------------------*/
 
 static void cdg_start_client_code_callback(ThreadId tid, ULong blocks_done) {
-	static ULong last_blocks_done = 0;
-
 	if (0)
 		VG_(printf)("%d R %llu\n", (Int) tid, blocks_done);
 
-	/* throttle calls to CGD_(run_thread) by number of BBs executed */
-	if (blocks_done - last_blocks_done < 5000)
-		return;
-	last_blocks_done = blocks_done;
-
+	/* Called every time the scheduler runs a thread: this is where
+	 * thread switches are detected, so setup_bb does not need to
+	 * query the running thread. CGD_(run_thread) is cheap if the
+	 * thread did not change. */
 	CGD_(run_thread)(tid);
 }
 
@@ -831,6 +1536,34 @@ void CGD_(post_clo_init)(void) {
 		VG_(clo_vex_control).guest_chase = False; // cannot be overridden.
 	}
 
+#if CFG_NODE_CACHE_SIZE > 0
+	if ((CGD_(clo).node_cache.size & (CGD_(clo).node_cache.size - 1)) != 0)
+		VG_(fmsg_bad_option)("--node-cache-size",
+				"must be a power of 2\n");
+	if ((CGD_(clo).node_cache.ways & (CGD_(clo).node_cache.ways - 1)) != 0 ||
+			CGD_(clo).node_cache.ways > CGD_(clo).node_cache.size)
+		VG_(fmsg_bad_option)("--node-cache-ways",
+				"must be a power of 2 not greater than --node-cache-size\n");
+
+	CGD_(clo).node_cache.sets_mask =
+			(CGD_(clo).node_cache.size / CGD_(clo).node_cache.ways) - 1;
+#endif
+
+#if ENABLE_PROFILING
+	if (CGD_(clo).sample.off > 0 && CGD_(clo).cfg_infile &&
+			!CGD_(clo).ignore_profiling) {
+		VG_(message)(Vg_UserMsg,
+				"cfggrind cannot merge exact counts with sampled ones (--sample)\n"
+						"=> ignoring the profiling information of --cfg-infile\n");
+		CGD_(clo).ignore_profiling = True;
+	}
+
+	// The first burst starts with the first BB.
+	CGD_(sample).left = CGD_(clo).sample.on;
+	CGD_(sample).burst = 1;
+	CGD_(sample).off = False;
+#endif
+
 	CGD_(init_statistics)(&CGD_(stat));
 
 	/* initialize hash tables */
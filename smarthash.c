@@ -27,127 +27,95 @@
 
 #include "global.h"
 
-#ifdef TRACKING_CELLS
-  #define OPTIMIZED_HASHTABLE
-#endif
+/* A flat open addressing table with linear probing. The key of each value
+ * is kept next to it, so the key function is only called once per insertion
+ * and probes compare keys directly. A null value marks an empty entry. */
+typedef struct _SmartEntry SmartEntry;
+struct _SmartEntry {
+	HWord key;
+	void* value;
+};
 
 struct _SmartHash {
 	Int count;
-	Int size;
+	Int size;			// power of 2
 	Bool fixed;
 	Float growth_rate;
-#ifdef OPTIMIZED_HASHTABLE
-	SmartList* track;
-#endif
-	SmartList** table; // SmartList<void*>
+	SmartEntry* table;
 };
 
-#ifdef OPTIMIZED_HASHTABLE
-//static
-//Bool cmp_values(void* v1, void* v2) {
-//	return v1 != 0 && v2 != 0 && v1 == v2;
-//}
+static __inline__
+Int hash_idx(HWord key, Int size) {
+	// Mix the high bits in, most keys are (aligned) addresses.
+	key ^= (key >> 16);
+	key *= 0x45d9f3b;
+	key ^= (key >> 16);
 
-static
-void add_tracking_value(SmartHash* shash, Int index) {
-	void* v;
+	return (Int) (key & (size - 1));
+}
+
+// The entry of the key, or the empty entry where it belongs.
+static __inline__
+SmartEntry* find_entry(SmartHash* shash, HWord key) {
+	Int idx;
 
-	v = (void*) (((HWord) index) + 1);
-	CGD_ASSERT(shash->table[index] != 0 && CGD_(smart_list_count)(shash->table[index]) == 1);
-//	CGD_ASSERT(!CGD_(smart_list_contains)(shash->track, v, cmp_values));
-	CGD_(smart_list_add)(shash->track, v);
+	idx = hash_idx(key, shash->size);
+	while (shash->table[idx].value && shash->table[idx].key != key)
+		idx = (idx + 1) & (shash->size - 1);
+
+	return &(shash->table[idx]);
 }
 
+// Remove the entry shifting back the following ones of the cluster
+// that could not be found from their home entries anymore.
 static
-void remove_tracking_value(SmartHash* shash, Int index) {
-	Int i, count;
-
-	CGD_ASSERT(shash->table[index] == 0 || CGD_(smart_list_is_empty)(shash->table[index]));
-
-	count = CGD_(smart_list_count)(shash->track);
-	for (i = 0; i < count; i++) {
-		Int v = ((HWord) CGD_(smart_list_at)(shash->track, i)) - 1;
-		if (v == index) {
-			CGD_(smart_list_set)(shash->track, i, CGD_(smart_list_at)(shash->track, (count - 1)));
-			CGD_(smart_list_set)(shash->track, (count - 1), 0);
-			return;
+void remove_entry(SmartHash* shash, Int hole) {
+	Int idx, home;
+
+	CGD_ASSERT(shash->table[hole].value != 0);
+
+	idx = hole;
+	while (True) {
+		idx = (idx + 1) & (shash->size - 1);
+		if (!shash->table[idx].value)
+			break;
+
+		home = hash_idx(shash->table[idx].key, shash->size);
+		if (((idx - home) & (shash->size - 1)) >= ((idx - hole) & (shash->size - 1))) {
+			shash->table[hole] = shash->table[idx];
+			hole = idx;
 		}
 	}
 
-	tl_assert(0);
+	shash->table[hole].key = 0;
+	shash->table[hole].value = 0;
+	--shash->count;
 }
-#endif
 
 static
-void grow_smart_hash(SmartHash* shash, HWord (*hash_key)(void*)) {
-	Int idx, new_idx, new_size;
-	Int i, count, j, count2;
-	HWord key;
-	void* value;
-	SmartList* list;
-	SmartList** new_table;
-	SmartList** new_list;
-#ifdef OPTIMIZED_HASHTABLE
-	SmartList* new_track;
-#endif
-
-	new_size = (Int) (shash->size * shash->growth_rate);
+void grow_smart_hash(SmartHash* shash) {
+	Int idx, old_size, new_size;
+	SmartEntry* old_table;
+
+	// Keep the size a power of 2.
+	new_size = 1;
+	while (new_size < (Int) (shash->size * shash->growth_rate))
+		new_size <<= 1;
 	CGD_ASSERT(new_size > shash->size);
 
-	new_table = (SmartList**) CGD_MALLOC("cgd.smarthash.gsh.1", (new_size * sizeof(SmartList*)));
-	VG_(memset)(new_table, 0, (new_size * sizeof(SmartList*)));
-
-#ifdef OPTIMIZED_HASHTABLE
-	new_track = CGD_(new_smart_list)(128);
-
-	count = CGD_(smart_list_count)(shash->track);
-	for (i = 0; i < count; i++) {
-		idx = ((HWord) CGD_(smart_list_at)(shash->track, i)) - 1;
-		list = shash->table[idx];
-		CGD_ASSERT(list != 0 && !CGD_(smart_list_is_empty)(list));
-#else
-	CGD_UNUSED(i);
-	CGD_UNUSED(count);
-	for (idx = 0; idx < shash->size; idx++) {
-		list = shash->table[idx];
-		if (!list)
-			continue;
-#endif
-		count2 = CGD_(smart_list_count)(list);
-		for (j = 0; j < count2; j++) {
-			value = CGD_(smart_list_at)(list, j);
-			CGD_ASSERT(value != 0);
-
-			key = (*hash_key)(value);
-			new_idx = key % new_size;
-
-			new_list = &(new_table[new_idx]);
-			if (!*new_list)
-				*new_list = CGD_(new_smart_list)(1);
-
-			CGD_(smart_list_add)(*new_list, value);
-#ifdef OPTIMIZED_HASHTABLE
-			if (CGD_(smart_list_count)(*new_list) == 1)
-				CGD_(smart_list_add)(new_track, (void*) (((HWord) new_idx) + 1));
-#endif
-
-			CGD_(smart_list_set)(list, j, 0);
-		}
-
-		CGD_(delete_smart_list)(list);
-	}
-
-	CGD_FREE(shash->table);
+	old_size = shash->size;
+	old_table = shash->table;
 
 	shash->size = new_size;
-	shash->table = new_table;
+	shash->table = (SmartEntry*) CGD_MALLOC("cgd.smarthash.gsh.1", (new_size * sizeof(SmartEntry)));
+	VG_(memset)(shash->table, 0, (new_size * sizeof(SmartEntry)));
 
-#ifdef OPTIMIZED_HASHTABLE
-	CGD_(smart_list_clear)(shash->track, 0);
-	CGD_(delete_smart_list)(shash->track);
+	for (idx = 0; idx < old_size; idx++) {
+		if (old_table[idx].value)
+			*find_entry(shash, old_table[idx].key) = old_table[idx];
+	}
 
-	shash->track = new_track;
-#endif
+	CGD_DATA_FREE(old_table, (old_size * sizeof(SmartEntry)));
 }
 
 static
@@ -156,22 +124,23 @@ SmartHash* create_smart_hash(Int size, Bool fixed) {
 
 	CGD_ASSERT(size > 0);
 
-	// Make it 7 multiple.
-	size += size % 7;
-
 	shash = (SmartHash*) CGD_MALLOC("cgd.smarthash.nsh.1", sizeof(SmartHash));
 	VG_(memset)(shash, 0, sizeof(SmartHash));
 
-	shash->size = size;
+	// Make it a power of 2.
+	shash->size = 1;
+	while (shash->size < size)
+		shash->size <<= 1;
+
+	// A fixed hash can not grow, keep room for all of its values.
+	if (fixed)
+		shash->size <<= 1;
+
 	shash->fixed = fixed;
 	shash->growth_rate = 2.0f; // default: double the hash.
 
-#ifdef OPTIMIZED_HASHTABLE
-	shash->track = CGD_(new_smart_list)(128);
-#endif
-
-	shash->table = (SmartList**) CGD_MALLOC("cgd.smarthash.nsh.2", (size * sizeof(SmartList*)));
-	VG_(memset)(shash->table, 0, (size * sizeof(SmartList*)));
+	shash->table = (SmartEntry*) CGD_MALLOC("cgd.smarthash.nsh.2", (shash->size * sizeof(SmartEntry)));
+	VG_(memset)(shash->table, 0, (shash->size * sizeof(SmartEntry)));
 
 	return shash;
 }
@@ -185,77 +154,27 @@ SmartHash* CGD_(new_fixed_smart_hash)(Int size) {
 }
 
 void CGD_(delete_smart_hash)(SmartHash* shash) {
-	Int idx, i, count;
-	SmartList* list;
-
 	CGD_ASSERT(shash != 0);
 	CGD_ASSERT(shash->count == 0);
 
-#ifdef OPTIMIZED_HASHTABLE
-	count = CGD_(smart_list_count)(shash->track);
-	for (i = 0; i < count; i++) {
-		idx = ((HWord) CGD_(smart_list_at)(shash->track, i)) - 1;
-		list = shash->table[idx];
-		CGD_ASSERT(list != 0 && !CGD_(smart_list_is_empty)(list));
-#else
-	CGD_UNUSED(i);
-	CGD_UNUSED(count);
-	for (idx = 0; idx < shash->size; idx++) {
-		list = shash->table[idx];
-		if (!list)
-			continue;
-#endif
-		CGD_ASSERT(CGD_(smart_list_is_empty)(list));
-		CGD_(delete_smart_list)(list);
-	}
-
-#ifdef OPTIMIZED_HASHTABLE
-	CGD_ASSERT(CGD_(smart_list_is_empty)(shash->track));
-	CGD_(delete_smart_list)(shash->track);
-#endif
-
-	CGD_FREE(shash->table);
-	CGD_FREE(shash);
+	CGD_DATA_FREE(shash->table, (shash->size * sizeof(SmartEntry)));
+	CGD_DATA_FREE(shash, sizeof(SmartHash));
 }
 
 void CGD_(smart_hash_clear)(SmartHash* shash, void (*remove_value)(void*)) {
-	Int idx, i, count, j, count2;
-	void* v;
-	SmartList* list;
+	Int idx;
 
 	CGD_ASSERT(shash != 0);
 
-#ifdef OPTIMIZED_HASHTABLE
-	count = CGD_(smart_list_count)(shash->track);
-	for (i = 0; i < count; i++) {
-		idx = ((HWord) CGD_(smart_list_at)(shash->track, i)) - 1;
-		list = shash->table[idx];
-		CGD_ASSERT(list != 0 && !CGD_(smart_list_is_empty)(list));
-#else
-	CGD_UNUSED(i);
-	CGD_UNUSED(count);
-	for (idx = 0; idx < shash->size; idx++) {
-		list = shash->table[idx];
-		if (!list)
-			continue;
-#endif
-		count2 = CGD_(smart_list_count)(list);
-		for (j = 0; j < count2; j++) {
-			v = CGD_(smart_list_at)(list, j);
-			CGD_ASSERT(v != 0);
-			CGD_ASSERT(shash->count > 0);
-
-			if (remove_value)
-				(*remove_value)(v);
-
-			--shash->count;
-			CGD_(smart_list_set)(list, j, 0);
+	if (remove_value) {
+		for (idx = 0; idx < shash->size; idx++) {
+			if (shash->table[idx].value)
+				(*remove_value)(shash->table[idx].value);
 		}
 	}
 
-#ifdef OPTIMIZED_HASHTABLE
-	CGD_(smart_list_clear)(shash->track, 0);
-#endif
+	VG_(memset)(shash->table, 0, (shash->size * sizeof(SmartEntry)));
+	shash->count = 0;
 }
 
 Int CGD_(smart_hash_count)(SmartHash* shash) {
@@ -286,115 +205,61 @@ void CGD_(smart_hash_set_growth_rate)(SmartHash* shash, Float rate) {
 }
 
 void* CGD_(smart_hash_get)(SmartHash* shash, HWord key, HWord (*hash_key)(void*)) {
-	Int idx;
-	void* v;
-	SmartList* list;
-
 	CGD_ASSERT(shash != 0);
 	CGD_ASSERT(hash_key != 0);
 
-	idx = key % shash->size;
-	if ((list = shash->table[idx])) {
-		Int i, count;
-
-		count = CGD_(smart_list_count)(list);
-		for (i = 0; i < count; i++) {
-			v = CGD_(smart_list_at)(list, i);
-			CGD_ASSERT(v != 0);
-
-			if ((*hash_key)(v) == key)
-				return v;
-		}
-	}
-
-	// Not found.
-	return 0;
+	// Empty entries have a null value, so it is not found.
+	return find_entry(shash, key)->value;
 }
 
 void* CGD_(smart_hash_put)(SmartHash* shash, void* value, HWord (*hash_key)(void*)) {
-	Int idx;
 	HWord key;
 	void* v;
-	SmartList** list;
+	SmartEntry* entry;
 
 	CGD_ASSERT(shash != 0);
 	CGD_ASSERT(value != 0);
 	CGD_ASSERT(hash_key != 0);
 
-	if (!shash->fixed) {
-		if ((10 * shash->count / shash->size) > 6)
-			grow_smart_hash(shash, hash_key);
-	}
-
-	idx = (*hash_key)(value) % shash->size;
-	list = &(shash->table[idx]);
-
-	if (!*list)
-		*list = CGD_(new_smart_list)(1);
-	else {
-		Int i, count;
+	key = (*hash_key)(value);
+	entry = find_entry(shash, key);
+	if ((v = entry->value)) {
+		// Replace with the new value.
+		entry->value = value;
 
-		key = (*hash_key)(value);
-		count = CGD_(smart_list_count)(*list);
-		for (i = 0; i < count; i++) {
-			v = CGD_(smart_list_at)(*list, i);
-			CGD_ASSERT(v != 0);
+		// Return the old value.
+		return v;
+	}
 
-			if ((*hash_key)(v) == key) {
-				// Replace with the new value.
-				CGD_(smart_list_set)(*list, i, value);
+	// Keep the load factor up to 70%.
+	if (10 * (shash->count + 1) > 7 * shash->size) {
+		if (shash->fixed)
+			VG_(tool_panic)("cfggrind: not allowed to enlarge this smart hash");
 
-				// Return the old value.
-				return v;
-			}
-		}
+		grow_smart_hash(shash);
+		entry = find_entry(shash, key);
 	}
 
-	CGD_(smart_list_add)(*list, value);
-#ifdef OPTIMIZED_HASHTABLE
-	if (CGD_(smart_list_count)(*list) == 1)
-		add_tracking_value(shash, idx);
-#endif
-
+	entry->key = key;
+	entry->value = value;
 	++shash->count;
 
 	return 0;
 }
 
 void* CGD_(smart_hash_remove)(SmartHash* shash, HWord key, HWord (*hash_key)(void*)) {
-	Int idx;
 	void* v;
-	SmartList* list;
+	SmartEntry* entry;
 
 	CGD_ASSERT(shash != 0);
 	CGD_ASSERT(hash_key != 0);
 
-	idx = key % shash->size;
-	if ((list = shash->table[idx])) {
-		Int i, count;
-
-		count = CGD_(smart_list_count)(list);
-		for (i = 0; i < count; i++) {
-			v = CGD_(smart_list_at)(list, i);
-			CGD_ASSERT(v != 0);
-
-			if ((*hash_key)(v) == key) {
-				CGD_(smart_list_set)(list, i, CGD_(smart_list_at)(list, (count - 1)));
-				CGD_(smart_list_set)(list, (count - 1), 0);
-				--shash->count;
+	entry = find_entry(shash, key);
+	if ((v = entry->value))
+		remove_entry(shash, (entry - shash->table));
 
-#ifdef OPTIMIZED_HASHTABLE
-				if (CGD_(smart_list_is_empty)(list))
-					remove_tracking_value(shash, idx);
-#endif
-
-				// Return the old value.
-				return v;
-			}
-		}
-	}
-
-	return 0;
+	// Return the old value.
+	return v;
 }
 
 Bool CGD_(smart_hash_contains)(SmartHash* shash, HWord key, HWord (*hash_key)(void*)) {
@@ -402,97 +267,46 @@ Bool CGD_(smart_hash_contains)(SmartHash* shash, HWord key, HWord (*hash_key)(vo
 }
 
 void CGD_(smart_hash_forall)(SmartHash* shash, Bool (*func)(void*, void*), void* arg) {
-	Int idx, i, count, j, count2;
-	void* v;
-	SmartList* list;
+	Int start, i, idx;
 
 	CGD_ASSERT(shash != 0);
 	CGD_ASSERT(func != 0);
 
-#ifdef OPTIMIZED_HASHTABLE
-	count = CGD_(smart_list_count)(shash->track);
-
-	i = 0;
-	while (i < count) {
-		idx = ((HWord) CGD_(smart_list_at)(shash->track, i)) - 1;
-		list = shash->table[idx];
-		CGD_ASSERT(list != 0 && !CGD_(smart_list_is_empty)(list));
-#else
-	CGD_UNUSED(i);
-	CGD_UNUSED(count);
-	for (idx = 0; idx < shash->size; idx++) {
-		list = shash->table[idx];
-		if (!list)
-			continue;
-#endif
-
-		count2 = CGD_(smart_list_count)(list);
-		for (j = count2 - 1; j >= 0; j--) {
-			v = CGD_(smart_list_at)(list, j);
-			CGD_ASSERT(v != 0);
-
-			if ((*func)(v, arg)) {
-				Int last = CGD_(smart_list_count)(list) - 1;
-
-				if (j != last)
-					CGD_(smart_list_set)(list, j, CGD_(smart_list_at)(list, last));
-
-				CGD_(smart_list_set)(list, last, 0);
-				--shash->count;
-			}
-		}
-
-#ifdef OPTIMIZED_HASHTABLE
-		if (CGD_(smart_list_is_empty)(list)) {
-			CGD_(smart_list_set)(shash->track, i, CGD_(smart_list_at)(shash->track, (count - 1)));
-			CGD_(smart_list_set)(shash->track, (count - 1), 0);
-
-			--count;
+	if (shash->count == 0)
+		return;
+
+	// Start right after an empty entry, so no cluster wraps around the
+	// end of the walk and the values shifted back by a removal are the
+	// ones not visited yet.
+	start = 0;
+	while (shash->table[start].value)
+		start++;
+
+	i = 1;
+	while (i <= shash->size) {
+		idx = (start + i) & (shash->size - 1);
+		if (shash->table[idx].value && (*func)(shash->table[idx].value, arg)) {
+			// Visit the same entry again, another value may be there now.
+			remove_entry(shash, idx);
 		} else {
 			i++;
 		}
-#endif
 	}
 }
 
 // This method moves elements to dst from src (removing them).
 void CGD_(smart_hash_merge)(SmartHash* dst, SmartHash* src, HWord (*hash_key)(void*)) {
-	Int idx, i, count, j, count2;
-	void* v;
-	SmartList* list;
+	Int idx;
 
+	CGD_ASSERT(dst != 0);
 	CGD_ASSERT(src != 0);
 	CGD_ASSERT(hash_key != 0);
 
-#ifdef OPTIMIZED_HASHTABLE
-	count = CGD_(smart_list_count)(src->track);
-	for (i = 0; i < count; i++) {
-		idx = ((HWord) CGD_(smart_list_at)(src->track, i)) - 1;
-		list = src->table[idx];
-		CGD_ASSERT(list != 0 && !CGD_(smart_list_is_empty)(list));
-#else
-	CGD_UNUSED(i);
-	CGD_UNUSED(count);
 	for (idx = 0; idx < src->size; idx++) {
-		list = src->table[idx];
-		if (!list)
-			continue;
-#endif
-
-		count2 = CGD_(smart_list_count)(list);
-		for (j = count2 - 1; j >= 0; j--) {
-			v = CGD_(smart_list_at)(list, j);
-			CGD_ASSERT(v != 0);
-
-			CGD_(smart_list_set)(list, j, 0);
-			src->count--;
-
-			CGD_(smart_hash_put)(dst, v, hash_key);
-		}
+		if (src->table[idx].value)
+			CGD_(smart_hash_put)(dst, src->table[idx].value, hash_key);
 	}
 
+	CGD_(smart_hash_clear)(src, 0);
 	CGD_ASSERT(CGD_(smart_hash_is_empty)(src));
-#ifdef OPTIMIZED_HASHTABLE
-	CGD_(smart_list_clear)(src->track, 0);
-#endif
 }
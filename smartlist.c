@@ -59,9 +59,46 @@ struct _SmartList {
 	Int size;
 	Bool fixed;
 	Float growth_rate;
+#ifdef USING_CHAIN_SMART_LIST
 	SmartNode* data;
+#else
+	// A single node embedded in the header, its list is either
+	// the inline elements below or an allocated array.
+	SmartNode data[1];
+	void* inline_list[SMART_LIST_INLINE_SIZE];
+#endif
 };
 
+#if POOL_ALLOC
+/* Pools of the smart list headers, created on first use since
+ * lists are already needed while processing the options. */
+static struct {
+	PoolAlloc* lists;
+#ifdef USING_CHAIN_SMART_LIST
+	PoolAlloc* nodes;
+#endif
+} slist_pools;
+
+static __inline__
+void init_slist_pools(void) {
+	if (UNLIKELY(slist_pools.lists == 0)) {
+		slist_pools.lists = VG_(newPA)(sizeof(SmartList), 1024,
+					VG_(malloc), "cgd.smartlist.isp.1", VG_(free));
+#ifdef USING_CHAIN_SMART_LIST
+		slist_pools.nodes = VG_(newPA)(sizeof(SmartNode), 1024,
+					VG_(malloc), "cgd.smartlist.isp.2", VG_(free));
+#endif
+	}
+}
+#endif
+
+#ifdef USING_REALLOC_SMART_LIST
+static __inline__
+Bool is_inline_list(SmartList* slist) {
+	return slist->data->list == slist->inline_list;
+}
+#endif
+
 static
 void grow_smart_list(SmartList* slist) {
 	CGD_ASSERT(slist != 0);
@@ -99,7 +136,7 @@ void grow_smart_list(SmartList* slist) {
 		CGD_ASSERT(slist->size > 0);
 		CGD_DEBUG(3, "%u\n", slist->size);
 
-		*snode = (SmartNode*) CGD_MALLOC("cgd.smartlist.gsl.1", sizeof(SmartNode));
+		*snode = (SmartNode*) CGD_POOL_MALLOC(slist_pools.nodes, "cgd.smartlist.gsl.1", sizeof(SmartNode));
 		(*snode)->size = last_size;
 		(*snode)->list = (void**) CGD_MALLOC("cgd.smartlist.gsl.2", (last_size * sizeof(void*)));
 		VG_(memset)((*snode)->list, 0, (last_size * sizeof(void*)));
@@ -111,8 +148,18 @@ void grow_smart_list(SmartList* slist) {
 		CGD_ASSERT(new_size > slist->size);
 		CGD_DEBUG(3, "%d\n", new_size);
 
-		slist->data->list = CGD_REALLOC("cgd.smartlist.gsl.1",
-				slist->data->list, (new_size * sizeof(void*)));
+		// Move the elements out of the header once they do not fit in it.
+		if (is_inline_list(slist)) {
+			if (new_size > SMART_LIST_INLINE_SIZE) {
+				slist->data->list = (void**) CGD_MALLOC("cgd.smartlist.gsl.2",
+						(new_size * sizeof(void*)));
+				VG_(memcpy)(slist->data->list, slist->inline_list,
+						(slist->size * sizeof(void*)));
+			}
+		} else {
+			slist->data->list = CGD_REALLOC("cgd.smartlist.gsl.1",
+					slist->data->list, (new_size * sizeof(void*)));
+		}
 		VG_(memset)((slist->data->list + slist->size), 0,
 				((new_size - slist->size) * sizeof(void*)));
 		slist->size = new_size;
@@ -128,20 +175,27 @@ SmartList* create_smart_list(Int size, Bool fixed) {
 
 	CGD_DEBUG(3, "[smartlist] new smart list\n");
 
-	slist = (SmartList*) CGD_MALLOC("cgd.smartlist.nsl.1", sizeof(SmartList));
+#if POOL_ALLOC
+	init_slist_pools();
+#endif
+
+	slist = (SmartList*) CGD_POOL_MALLOC(slist_pools.lists, "cgd.smartlist.nsl.1", sizeof(SmartList));
 	slist->elements = 0;
 	slist->size = size;
 	slist->fixed = fixed;
 	slist->growth_rate = 2.0f; // default: double the list.
-	slist->data = (SmartNode*) CGD_MALLOC("cgd.smartlist.nsl.2", sizeof(SmartNode));
 
 #ifdef USING_CHAIN_SMART_LIST
+	slist->data = (SmartNode*) CGD_POOL_MALLOC(slist_pools.nodes, "cgd.smartlist.nsl.2", sizeof(SmartNode));
 	slist->data->list = (void**) CGD_MALLOC("cgd.smartlist.nsl.3", (size * sizeof(void*)));
 	VG_(memset)(slist->data->list, 0, (size * sizeof(void*)));
 	slist->data->size = size;
 	slist->data->next = 0;
 #else
-	slist->data->list = (void**) CGD_MALLOC("cgd.smartlist.nsl.3", (size * sizeof(void*)));
+	if (size <= SMART_LIST_INLINE_SIZE)
+		slist->data->list = slist->inline_list;
+	else
+		slist->data->list = (void**) CGD_MALLOC("cgd.smartlist.nsl.3", (size * sizeof(void*)));
 	VG_(memset)(slist->data->list, 0, (size * sizeof(void*)));
 #endif
 
@@ -192,16 +246,16 @@ void CGD_(delete_smart_list)(SmartList* slist) {
 		SmartNode* tmp = snode->next;
 
 		CGD_DATA_FREE(snode->list, (snode->size * sizeof(void*)));
-		CGD_DATA_FREE(snode, sizeof(SmartNode));
+		CGD_POOL_FREE(slist_pools.nodes, snode, sizeof(SmartNode));
 
 		snode = tmp;
 	}
 #else
-	CGD_DATA_FREE(snode->list, (slist->size * sizeof(void*)));
-	CGD_DATA_FREE(snode, sizeof(SmartNode));
+	if (!is_inline_list(slist))
+		CGD_DATA_FREE(snode->list, (slist->size * sizeof(void*)));
 #endif
 
-	CGD_DATA_FREE(slist, sizeof(SmartList));
+	CGD_POOL_FREE(slist_pools.lists, slist, sizeof(SmartList));
 }
 
 void CGD_(smart_list_clear)(SmartList* slist, void (*remove_element)(void*)) {
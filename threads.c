@@ -195,6 +195,9 @@ void CGD_(pre_signal)(ThreadId tid, Int sigNum, Bool alt_stack)
 {
     exec_state* es;
 	exec_state* old_es;
+#if ENABLE_PROFILING
+	Bool synced;
+#endif
 
     CGD_DEBUG(0, ">> pre_signal(TID %u, sig %d, alt_st %s)\n",
 	     tid, sigNum, alt_stack ? "yes":"no");
@@ -204,6 +207,9 @@ void CGD_(pre_signal)(ThreadId tid, Int sigNum, Bool alt_stack)
 
     /* save current execution state */
     old_es = exec_state_save();
+#if ENABLE_PROFILING
+    synced = sample_is_synced();
+#endif
 
     /* setup new cxtinfo struct for this signal handler */
     es = push_exec_state(sigNum);
@@ -216,6 +222,11 @@ void CGD_(pre_signal)(ThreadId tid, Int sigNum, Bool alt_stack)
 	// Restore CFG and working for signal mapping.
 	CGD_(current_state).cfg = old_es->cfg;
 	CGD_(current_state).working = old_es->working;
+#if ENABLE_PROFILING
+	// The interrupted code is unknown if its state missed BBs.
+	if (!synced)
+		CGD_(current_state).burst = 0;
+#endif
 }
 
 /* Run post-signal if the stackpointer for call stack is at
@@ -252,8 +263,16 @@ void CGD_(post_signal)(ThreadId tid, Int sigNum)
     while(CGD_(current_call_stack).sp > es->call_stack_bottom)
       CGD_(pop_call_stack)(False);
 
-    // Connect the end of the signal handler to the exit node.
-    CGD_(cfgnode_set_exit)(CGD_(current_state).cfg, CGD_(current_state).working);
+    if (state_is_tracked()) {
+      // Connect the end of the signal handler to the exit node.
+      CGD_(cfgnode_set_exit)(CGD_(current_state).cfg, CGD_(current_state).working);
+
+#if INLINE_EXIT_COUNTS
+      // No BB follows the last exit taken in the handler.
+      if (CGD_(current_state).bb)
+        CGD_(bb_uncount_exit)(CGD_(current_state).bb, CGD_(current_state).jmps_passed);
+#endif
+    }
 
     /* restore previous context */
     es->sig = -1;
@@ -262,9 +281,9 @@ void CGD_(post_signal)(ThreadId tid, Int sigNum)
     CGD_(current_state).sig = es->sig;
     exec_state_restore();
 
-    /* There is no way to reliable get the thread ID we are switching to
-     * after this handler returns. So we sync with actual TID at start of
-     * CGD_(setup_bb)(), which should be the next for cfggrind.
+    /* The interrupted code of thread tid continues after this handler
+     * returns; any later switch to another thread is reported by the
+     * scheduler through the start_client_code callback.
      */
 }
 
@@ -289,6 +308,9 @@ void CGD_(init_exec_state)(exec_state* es)
   es->bb = 0;
   es->cfg = 0;
   es->working = 0;
+#if ENABLE_PROFILING
+  es->burst = CGD_(sample).burst;
+#endif
 }
 
 
@@ -400,6 +422,9 @@ exec_state* exec_state_save(void)
   es->bb           = CGD_(current_state).bb;
   es->cfg          = CGD_(current_state).cfg;
   es->working     = CGD_(current_state).working;
+#if ENABLE_PROFILING
+  es->burst        = CGD_(current_state).burst;
+#endif
 
   CGD_DEBUGIF(1) {
     CGD_DEBUG(1, "  cxtinfo_save(sig %d): jmps_passed %d\n",
@@ -423,6 +448,13 @@ exec_state* exec_state_restore(void)
   CGD_(current_state).sig          = es->sig;
   CGD_(current_state).cfg          = es->cfg;
   CGD_(current_state).working     = es->working;
+#if ENABLE_PROFILING
+  CGD_(current_state).burst        = es->burst;
+
+  /* A state that missed BBs must not match the inline fast path */
+  if (!sample_is_synced())
+    CGD_(current_state).bb = 0;
+#endif
 
   CGD_DEBUGIF(1) {
 	CGD_DEBUG(1, "  exec_state_restore(sig %d): jmps_passed %d\n",